@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -11,8 +12,12 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <string>
 #include <sstream>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -136,11 +141,9 @@ std::string EscapeString(const std::string &s) {
 }
 
 bool Write(Player &player, std::string s) {
-  // Temporarily ignore SIGPIPE to avoid aborting the process if the write
-  // fails. This makes this function non-thread-safe!
-  void (*old_handler)(int) = signal(SIGPIPE, SIG_IGN);
+  // SIGPIPE is ignored (see main()), so a write to a player that has exited
+  // fails instead of aborting the process.
   ssize_t size_written = write(player.fd_in, s.data(), s.size());
-  signal(SIGPIPE, old_handler);
   if (size_written != static_cast<ssize_t>(s.size())) {
     fprintf(stderr, "Write %s failed!\n", EscapeString(s).c_str());
     return false;
@@ -149,7 +152,12 @@ bool Write(Player &player, std::string s) {
 }
 
 void Quit(Player &player) {
-  Write(player, "Quit\n");
+  // Players may exit by themselves at the end of the game, which is more
+  // likely to happen first when games run concurrently, so a failed write is
+  // not reported here.
+  static const char quit[] = "Quit\n";
+  ssize_t size_written = write(player.fd_in, quit, sizeof(quit) - 1);
+  (void)size_written;
   close(player.fd_in);
   int status = 0;
   if (waitpid(player.pid, &status, 0) != player.pid) {
@@ -163,8 +171,11 @@ void Quit(Player &player) {
 Player SpawnPlayer(const char *command, const char *log_filename) {
   int pipe_in[2];
   int pipe_out[2];
-  if (pipe(pipe_in) != 0 || pipe(pipe_out) != 0) {
-    perror("pipe()");
+  // The pipes are closed on exec, so that players of games that run
+  // concurrently don't inherit each other's pipes (which would keep them open
+  // after a player exits). dup2() clears the flag on stdin and stdout.
+  if (pipe2(pipe_in, O_CLOEXEC) != 0 || pipe2(pipe_out, O_CLOEXEC) != 0) {
+    perror("pipe2()");
     exit(1);
   }
   pid_t pid = fork();
@@ -192,6 +203,9 @@ Player SpawnPlayer(const char *command, const char *log_filename) {
       perror("close()");
       exit(1);
     }
+    // Ignored signals stay ignored across exec, so restore the default that
+    // main() changed.
+    signal(SIGPIPE, SIG_DFL);
     execl("/bin/sh", "/bin/sh", "-c", command, NULL);
     perror("exec");
     exit(1);
@@ -465,9 +479,36 @@ GameResult RunGame(const char *command_player1, const char *command_player2,
   return {EncodeHistory(history), score, {time_used[0], time_used[1]}};
 }
 
+// Runs the given game number, in which player game%2 plays red, and writes the
+// players' logs to files starting with logs_prefix (if any).
+GameResult RunGameWithLogs(const char *const player_commands[2], int game,
+    const char *logs_prefix) {
+  int p = game & 1;
+  int q = 1 - p;
+
+  char filename_buf[2][1024];
+  if (logs_prefix == nullptr) {
+    snprintf(filename_buf[0], sizeof(filename_buf[0]), "/dev/null");
+    snprintf(filename_buf[1], sizeof(filename_buf[1]), "/dev/null");
+  } else if (strcmp(logs_prefix, "-") == 0) {
+    snprintf(filename_buf[0], sizeof(filename_buf[0]), "/dev/stderr");
+    snprintf(filename_buf[1], sizeof(filename_buf[1]), "/dev/stderr");
+  } else {
+    snprintf(filename_buf[0], sizeof(filename_buf[0]), "%s%04d_%d_%s",
+        logs_prefix, game, p, "red");
+    snprintf(filename_buf[1], sizeof(filename_buf[1]), "%s%04d_%d_%s",
+        logs_prefix, game, q, "blue");
+  }
+  return RunGame(player_commands[p], player_commands[q],
+      filename_buf[0], filename_buf[1]);
+}
+
+// Runs the games on `jobs` threads concurrently. Results are reported in game
+// order, as they would be if the games were played one after another.
+//
 // Maybe: support competition mode with random number of players?
 void Main(const char *player1_command, const char *player2_command, int rounds,
-    const char *logs_prefix) {
+    const char *logs_prefix, int jobs) {
   int wins[2] = {0, 0};
   int ties[2] = {0, 0};
   int losses[2] = {0, 0};
@@ -477,28 +518,40 @@ void Main(const char *player1_command, const char *player2_command, int rounds,
   double total_time[2] = {0.0, 0.0};
   double max_time[2] = {0.0, 0.0};
 
-  char filename_buf[2][1024];
-
   const char *player_commands[2] = {player1_command, player2_command};
   int games = rounds <= 0 ? 1 : 2*rounds;
+
+  std::vector<GameResult> results(games);
+  std::vector<bool> done(games);
+  std::mutex mutex;
+  std::condition_variable result_ready;
+  std::atomic<int> next_game{0};
+  auto worker = [&]() {
+    for (int game; (game = next_game++) < games; ) {
+      GameResult result = RunGameWithLogs(player_commands, game, logs_prefix);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        results[game] = std::move(result);
+        done[game] = true;
+      }
+      result_ready.notify_one();
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 0; i < std::min(std::max(jobs, 1), games); ++i) {
+    threads.emplace_back(worker);
+  }
+
   for (int game = 0; game < games; ++game) {
     int p = game & 1;
     int q = 1 - p;
 
-    if (logs_prefix == nullptr) {
-      snprintf(filename_buf[0], sizeof(filename_buf[0]), "/dev/null");
-      snprintf(filename_buf[1], sizeof(filename_buf[1]), "/dev/null");
-    } else if (strcmp(logs_prefix, "-") == 0) {
-      snprintf(filename_buf[0], sizeof(filename_buf[0]), "/dev/stderr");
-      snprintf(filename_buf[1], sizeof(filename_buf[1]), "/dev/stderr");
-    } else {
-      snprintf(filename_buf[0], sizeof(filename_buf[0]), "%s%04d_%d_%s",
-          logs_prefix, game, p, "red");
-      snprintf(filename_buf[1], sizeof(filename_buf[1]), "%s%04d_%d_%s",
-          logs_prefix, game, q, "blue");
+    GameResult result;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      result_ready.wait(lock, [&]() { return bool(done[game]); });
+      result = std::move(results[game]);
     }
-    GameResult result = RunGame(player_commands[p], player_commands[q],
-        filename_buf[0], filename_buf[1]);
     printf("%4d: %s %s%d\n", game, result.transcript.c_str(),
         (result.score > 0 ? "+" : ""), result.score);
     score[p] += result.score;
@@ -518,6 +571,7 @@ void Main(const char *player1_command, const char *player2_command, int rounds,
     max_time[p] = std::max(max_time[p], result.walltime_used[0]);
     max_time[q] = std::max(max_time[q], result.walltime_used[1]);
   }
+  for (std::thread &thread : threads) thread.join();
   if (games > 1) {
     printf("\n");
     printf("Player               AvgTm MaxTm Wins Ties Loss Fail RedPts BluePt Total\n");
@@ -539,6 +593,7 @@ void Main(const char *player1_command, const char *player2_command, int rounds,
 
 int main(int argc, char *argv[]) {
   int opt_rounds = 0;
+  int opt_jobs = 1;
   const char *opt_logs_prefix = nullptr;
   // Parse option arguments.
   int j = 1;
@@ -551,6 +606,8 @@ int main(int argc, char *argv[]) {
     int value = 0;
     if (sscanf(argv[i], "--rounds=%d", &value) == 1) {
       opt_rounds = value;
+    } else if (sscanf(argv[i], "--jobs=%d", &value) == 1) {
+      opt_jobs = value;
     } else if (strncmp(argv[i], "--logs=", strlen("--logs=")) == 0) {
       opt_logs_prefix = arg + strlen("--logs=");
     } else {
@@ -559,9 +616,12 @@ int main(int argc, char *argv[]) {
   }
   argc = j;
   if (argc != 3) {
-    printf("Usage: arbiter [--rounds=<N>] [--logs=<filename-prefix>] <player1> <player2>\n");
+    printf("Usage: arbiter [--rounds=<N>] [--jobs=<N>] [--logs=<filename-prefix>] <player1> <player2>\n");
     return 1;
   }
-  Main(argv[1], argv[2], opt_rounds, opt_logs_prefix);
+  // Writes to players that have exited should fail rather than terminate the
+  // arbiter (see Write()).
+  signal(SIGPIPE, SIG_IGN);
+  Main(argv[1], argv[2], opt_rounds, opt_logs_prefix, opt_jobs);
   return 0;
 }
@@ -0,0 +1,114 @@
+#!/usr/bin/env python
+
+# Compares two benchmark result files, as written by "player benchmark", and
+# reports node count and speed regressions of the new results relative to the
+# old ones. Positions are matched by their state string.
+#
+# Exits with status 1 if any regression exceeds the thresholds.
+
+from __future__ import print_function
+
+import json
+import sys
+
+USAGE = '''Usage:
+
+  compare-benchmarks.py [--nodes=<pct>] [--speed=<pct>] <old.jsonl> <new.jsonl>
+
+    --nodes=<pct>  flag positions that search more than <pct>% more nodes
+                   (default: 10)
+    --speed=<pct>  flag positions that search more than <pct>% fewer nodes per
+                   second (default: 10)
+'''
+
+
+def ReadResults(filename):
+  """Returns the results keyed by state, and the number of error lines.
+
+  Error lines (as written by "player batch" for invalid or finished states)
+  have no search results, so they are counted but not compared.
+  """
+  results = {}
+  errors = 0
+  with open(filename) as f:
+    for line in f:
+      line = line.strip()
+      if line:
+        result = json.loads(line)
+        if 'error' in result:
+          errors += 1
+          continue
+        results[result['state']] = result
+  return results, errors
+
+
+def PercentChange(old, new):
+  return 100.0*(new - old)/old if old else 0.0
+
+
+def Main(args):
+  nodes_threshold = 10.0
+  speed_threshold = 10.0
+  filenames = []
+  for arg in args:
+    if arg.startswith('--nodes='):
+      nodes_threshold = float(arg[len('--nodes='):])
+    elif arg.startswith('--speed='):
+      speed_threshold = float(arg[len('--speed='):])
+    else:
+      filenames.append(arg)
+  if len(filenames) != 2:
+    print(USAGE, file=sys.stderr)
+    return 2
+  old_results, old_errors = ReadResults(filenames[0])
+  new_results, new_errors = ReadResults(filenames[1])
+  for filename, errors in ((filenames[0], old_errors), (filenames[1], new_errors)):
+    if errors:
+      print('%s: skipped %d error lines' % (filename, errors))
+
+  regressions = 0
+  old_nodes = new_nodes = old_time = new_time = 0
+  print('%5s %-12s %5s %11s %8s %10s %8s %s' % (
+      'index', 'best', 'depth', 'nodes', 'change', 'nps', 'change', 'flags'))
+  for state, new in sorted(new_results.items(), key=lambda item: item[1]['index']):
+    old = old_results.get(state)
+    if old is None:
+      continue
+    old_nodes += old['nodes']
+    new_nodes += new['nodes']
+    old_time += old['time']
+    new_time += new['time']
+    nodes_change = PercentChange(old['nodes'], new['nodes'])
+    speed_change = PercentChange(old['nps'], new['nps'])
+    flags = []
+    if nodes_change > nodes_threshold:
+      flags.append('NODES')
+    if -speed_change > speed_threshold:
+      flags.append('SPEED')
+    if old['depth'] != new['depth']:
+      flags.append('depth %d->%d' % (old['depth'], new['depth']))
+    if old['best'] != new['best']:
+      flags.append('best %s->%s' % (old['best'], new['best']))
+    if 'NODES' in flags or 'SPEED' in flags:
+      regressions += 1
+    print('%5d %-12s %5d %11d %+7.1f%% %10.0f %+7.1f%% %s' % (
+        new['index'], new['best'], new['depth'], new['nodes'], nodes_change,
+        new['nps'], speed_change, ' '.join(flags)))
+
+  missing = len(set(old_results) ^ set(new_results))
+  if missing:
+    print('%d positions occur in only one of the files' % missing)
+  old_nps = old_nodes/old_time if old_time else 0
+  new_nps = new_nodes/new_time if new_time else 0
+  print('total nodes: %d -> %d (%+.1f%%)' % (
+      old_nodes, new_nodes, PercentChange(old_nodes, new_nodes)))
+  print('total time: %.3fs -> %.3fs (%+.1f%%)' % (
+      old_time, new_time, PercentChange(old_time, new_time)))
+  print('nodes/second: %.0f -> %.0f (%+.1f%%)' % (
+      old_nps, new_nps, PercentChange(old_nps, new_nps)))
+  print('%d regressions' % regressions)
+  return 1 if regressions else 0
+
+
+if __name__ == '__main__':
+  sys.exit(Main(sys.argv[1:]))
@@ -11,20 +11,63 @@
 
 #include <assert.h>
 #include <execinfo.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <time.h>
+#include <unistd.h>
+
+#if __x86_64__
+#include <immintrin.h>
+#endif
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <numeric>
+#include <random>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
+// Number of heap allocations made through operator new, which is replaced here
+// to count them. With --check_allocations, RunGame() verifies that none are
+// made between receiving the opponent's move and sending ours.
+std::atomic<int64_t> heap_allocations{0};
+
+// The array and sized forms forward to the plain ones, so that every pair
+// matches. The plain ones are not inlined: otherwise gcc pairs malloc() or
+// free() with the other operator, and warns about a mismatched deallocation.
+
+__attribute__((noinline)) void *operator new(size_t size) {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { operator delete(p); }
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+void operator delete[](void *p, size_t) noexcept { operator delete(p); }
+
 namespace {
 
 using std::string;
@@ -39,14 +82,106 @@ const int MAX_MOVES = 2*MAX_VALUE;
 const int min_search_depth = 6;
 int max_search_depth = 30;
 int64_t max_nodes = 2500000;  // 2.5m
+
+// Time budget per move in seconds. If positive, SelectMove() deepens the search
+// while time remains instead of using max_nodes, and aborts a search in
+// progress when the deadline passes. Time is measured in wall time, or in CPU
+// time (of all threads combined) if use_cpu_time is set.
+double move_time = 0;
+bool use_cpu_time = false;
+
+// Time budget for the whole game in seconds. If positive, the time for each
+// move is allocated by PlanMoveTime(), and move_time is ignored.
+double game_time = 0;
+
+// Search on the opponent's time (see Ponderer).
+bool enable_pondering = false;
+
+// Abort if the heap is used while selecting a move (see heap_allocations).
+bool check_allocations = false;
+int64_t tt_size_mb = 16;
+
+// Positions with at most this many empty fields are solved exactly by Solve()
+// when the search reaches the end of the game. 0 disables the endgame solver.
+int endgame_empty_fields = 14;
+int64_t endgame_table_size_mb = 16;
+
+// Opening book file (see OpeningBook). When playing, the first move is taken
+// from the book if possible. In book mode, the book is written to this file.
+const char *book_path = nullptr;
+
+// Node limit for each position in book mode, which replaces max_nodes there.
+// Book moves are searched once, offline, so they can be searched much deeper
+// than moves during a game.
+int64_t book_max_nodes = 25000000;  // 25m
+
+// Persistent analysis cache file (see AnalysisCache), and the size in megabytes
+// it is created with if it does not exist yet.
+const char *cache_path = nullptr;
+int64_t cache_size_mb = 256;
+
+// Unix socket that serve mode listens on, instead of using stdin and stdout.
+const char *socket_path = nullptr;
+
 bool enable_move_ordering = true;
 
-// Heuristic: it always pays off to play the highest possible value. This
-// assumption allows us to cut the search space dramatically, seemingly
-// without sacrificing much strength.
-bool always_play_top_value = true;
+// Order moves inside Search() using killer moves and the history heuristic
+// (see OrderMoves()), in addition to the static order of enable_move_ordering.
+bool enable_killer_history = true;
+
+// Which values are searched for each move (see ValuesToSearch()):
+//
+//  TOP: heuristic: it always pays off to play the highest possible value. This
+//  assumption allows us to cut the search space dramatically, seemingly
+//  without sacrificing much strength.
+//
+//  ALL: all unused values are searched.
+//
+//  DOMINANCE: all unused values are searched, except those that are provably
+//  no better than another value on the same field.
+enum class ValueMode { TOP, ALL, DOMINANCE };
+
+const char *value_mode_names[] = {"top", "all", "dominance"};
 
-vector<int64_t> counter_search;
+ValueMode value_mode = ValueMode::TOP;
+
+// Engine used to select moves:
+//
+//  ALPHA_BETA: iterative deepening negamax search with a heuristic evaluation
+//  (see SelectMove()).
+//
+//  MCTS: Monte-Carlo tree search with playouts to the end of the game (see
+//  SelectMoveMcts()).
+enum class Engine { ALPHA_BETA, MCTS };
+
+const char *engine_names[] = {"alphabeta", "mcts"};
+
+Engine engine = Engine::ALPHA_BETA;
+
+// MCTS parameters: the UCT exploration constant, the size of the node arena,
+// and whether playouts pick the better of two random moves instead of a random
+// move. The value of each move in the tree and in playouts is restricted by
+// value_mode, like in the alpha-beta search.
+double mcts_exploration = 0.5;
+int64_t mcts_tree_size_mb = 64;
+bool mcts_guided_playouts = true;
+
+// Aspiration windows: each iteration of the iterative deepening search starts
+// with a window of +/- aspiration_window around the value of the previous
+// iteration. If the search fails low or high, the window is widened on that
+// side by a factor of aspiration_growth, and the search is repeated.
+// 0 disables aspiration windows.
+int aspiration_window = 16;
+int aspiration_growth = 4;
+
+// Kernels to use for score vector operations (see SelectKernels() below).
+// This is an upper bound; slower kernels are used if the CPU doesn't support
+// the requested ones.
+int requested_kernels = 2;  // AVX2
+
+// Number of search threads. Additional threads run helper searches that share
+// the transposition table with the main thread (see HelperSearch()).
+int num_threads = 1;
 
 int64_t wall_time_start_nanos;
 int64_t wall_time_suspended_nanos;
@@ -89,14 +224,411 @@ const int neighbours[36][7] = {
   {31,32,33,35,-1},        // 34: G2 -> F2,F3,G1,H1
   {33,34,-1}};             // 35: H1 -> G1,G2
 
+// Bitmask of all fields on the board.
+const uint64_t ALL_FIELDS = (uint64_t{1} << NUM_FIELDS) - 1;
+
+// Bitmask of all values a player can play (bit i is set for value i).
+const unsigned ALL_VALUES = ((1u << MAX_VALUE) - 1) << 1;
+
+// Bitmasks of the neighbours of each field, derived from the table above.
+struct NeighbourMasks {
+  NeighbourMasks() {
+    for (int field = 0; field < NUM_FIELDS; ++field) {
+      masks[field] = 0;
+      for (const int *ip = neighbours[field]; *ip >= 0; ++ip) {
+        masks[field] |= uint64_t{1} << *ip;
+      }
+    }
+  }
+
+  uint64_t operator[](int field) const { return masks[field]; }
+
+private:
+  uint64_t masks[NUM_FIELDS];
+};
+
+const NeighbourMasks neighbour_mask;
+
+inline int CountTrailingZeros(uint64_t mask) { return __builtin_ctzll(mask); }
+inline int PopCount(uint64_t mask) { return __builtin_popcountll(mask); }
+
+// Returns the index of the highest set bit in mask, which must be nonzero.
+inline int HighestBit(unsigned mask) { return 31 - __builtin_clz(mask); }
+
+// Removes the lowest set bit from mask, and returns its index.
+inline int PopLowestBit(uint64_t &mask) {
+  int i = CountTrailingZeros(mask);
+  mask &= mask - 1;
+  return i;
+}
+
+// Zobrist hash keys, indexed by field and signed stone value (offset by
+// MAX_VALUE, so index MAX_VALUE is used for the initial brown stones).
+struct ZobristTable {
+  ZobristTable() {
+    // SplitMix64, with a fixed seed so hashes are reproducible between runs.
+    uint64_t x = 0x5eed5eed5eed5eedULL;
+    for (int field = 0; field < NUM_FIELDS; ++field) {
+      for (int v = 0; v <= 2*MAX_VALUE; ++v) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        keys[field][v] = z ^ (z >> 31);
+      }
+    }
+  }
+
+  uint64_t operator()(int field, int v) const {
+    return keys[field][v + MAX_VALUE];
+  }
+
+private:
+  uint64_t keys[NUM_FIELDS][2*MAX_VALUE + 1];
+};
+
+const ZobristTable zobrist;
+
+int CoordsToFieldIndex(int u, int v) {
+  return SIZE*u - (u*(u - 1) >> 1) + v;
+}
+
+// Permutations of the fields under the 6 symmetries of the triangular board.
+// A field with coordinates (u,v) has a third coordinate w = SIZE - 1 - u - v,
+// and each symmetry permutes the three coordinates.
+struct Symmetries {
+  Symmetries() {
+    static const int perms[6][3] = {
+        {0, 1, 2}, {0, 2, 1}, {1, 0, 2}, {1, 2, 0}, {2, 0, 1}, {2, 1, 0}};
+    for (int s = 0; s < 6; ++s) {
+      for (int u = 0; u < SIZE; ++u) {
+        for (int v = 0; u + v < SIZE; ++v) {
+          const int coords[3] = {u, v, SIZE - 1 - u - v};
+          const int field = CoordsToFieldIndex(u, v);
+          const int image = CoordsToFieldIndex(coords[perms[s][0]], coords[perms[s][1]]);
+          fields[s][field] = image;
+          inverse[s][image] = field;
+        }
+      }
+    }
+  }
+
+  // Returns the image of the given field under symmetry s.
+  int Map(int s, int field) const { return fields[s][field]; }
+
+  // Returns the field that is mapped to the given field by symmetry s.
+  int Unmap(int s, int field) const { return inverse[s][field]; }
+
+  uint64_t MapMask(int s, uint64_t mask) const {
+    uint64_t result = 0;
+    while (mask) result |= uint64_t{1} << fields[s][PopLowestBit(mask)];
+    return result;
+  }
+
+  // Returns the lowest image of the given field under the symmetries in the
+  // given bitmask.
+  int Representative(unsigned mask, int field) const {
+    int result = field;
+    for (int s = 1; s < 6; ++s) {
+      if ((mask >> s) & 1) result = std::min(result, fields[s][field]);
+    }
+    return result;
+  }
+
+  // Returns the symmetry that maps the given mask to its canonical form (the
+  // lowest of its images).
+  int Canonicalize(uint64_t mask) const {
+    int best = 0;
+    for (int s = 1; s < 6; ++s) {
+      if (MapMask(s, mask) < MapMask(best, mask)) best = s;
+    }
+    return best;
+  }
+
+private:
+  int fields[6][NUM_FIELDS];
+  int inverse[6][NUM_FIELDS];
+};
+
+const Symmetries symmetries;
+
+// Number of bytes in the score vector: NUM_FIELDS rounded up to a multiple of
+// the size of the widest vector register (32 bytes for AVX2). Padding lanes
+// are always zero.
+const int SCORE_VECTOR_SIZE = 64;
+
+// Game state, packed so that it fits in two cache lines. Fields and values are
+// stored as bitmasks, so that moves can be generated by iterating over bits.
+// Scores are stored as a vector of bytes, so they can be updated with SIMD
+// instructions (the absolute value of a score never exceeds 6*15 = 90).
 struct State {
+  alignas(32) int8_t score[SCORE_VECTOR_SIZE] = {};
+  uint64_t occupied = 0;  // bit i is set if field i is occupied
+  uint64_t hash = 0;  // Zobrist hash of the occupied fields and their values
+  uint16_t used[2] = {};  // bit i is set if the player has used value i
   int moves_played = 0;  // excludes initial stones!
-  bool used[2][MAX_VALUE + 1] = {};
-  bool occupied[NUM_FIELDS] = {};
-  int value[NUM_FIELDS] = {};  // is this even used for anything?
-  int score[NUM_FIELDS] = {};
+  int eval = 0;  // evaluation from red's perspective; see Evaluate()
+  int8_t value[NUM_FIELDS] = {};  // signed value of each occupied field
+};
+
+static_assert(sizeof(State) <= 128, "State should fit in two cache lines");
+
+inline bool IsOccupied(const State &state, int field) {
+  return (state.occupied >> field) & 1;
+}
+
+inline uint64_t EmptyFields(const State &state) {
+  return ~state.occupied & ALL_FIELDS;
+}
+
+inline bool IsUsed(const State &state, int player, int value) {
+  return (state.used[player] >> value) & 1;
+}
+
+inline unsigned UnusedValues(const State &state, int player) {
+  return ~state.used[player] & ALL_VALUES;
+}
+
+// Byte masks of the neighbours of each field: element [i][j] is -1 (all bits
+// set) if field j is a neighbour of field i, or 0 otherwise.
+struct NeighbourByteMasks {
+  NeighbourByteMasks() {
+    for (int field = 0; field < NUM_FIELDS; ++field) {
+      for (int i = 0; i < SCORE_VECTOR_SIZE; ++i) {
+        masks[field][i] = i < NUM_FIELDS && ((neighbour_mask[field] >> i) & 1) ? -1 : 0;
+      }
+    }
+  }
+
+  const int8_t *operator[](int field) const { return masks[field]; }
+
+private:
+  alignas(32) int8_t masks[NUM_FIELDS][SCORE_VECTOR_SIZE];
 };
 
+const NeighbourByteMasks neighbour_byte_mask;
+
+// Returns the contribution of an empty field with the given score to the
+// evaluation function, from red's perspective.
+inline int FieldValue(int score) {
+  return score + 5*((score > 0) - (score < 0));
+}
+
+// Kernels that operate on the score vector. There is a scalar implementation
+// and vectorized SSE4 and AVX2 implementations; SelectKernels() picks one
+// at runtime based on what the CPU supports.
+//
+//  AddToNeighbours(score, field, v) adds v to the scores of all neighbours of
+//  the given field.
+//
+//  EvalDelta(score, field, v, empty) returns the change in the sum of
+//  FieldValue() over the neighbours of the given field that are in the `empty`
+//  mask, that would result from adding v to their scores.
+//
+//  SumEmptyScores(score, empty) returns the sum of FieldValue() over the
+//  fields in the `empty` mask. This is the evaluation function from red's
+//  perspective.
+enum class Kernels { SCALAR, SSE4, AVX2 };
+
+const char *kernels_names[] = {"scalar", "sse4", "avx2"};
+
+void AddToNeighboursScalar(int8_t *score, int field, int v) {
+  for (uint64_t m = neighbour_mask[field]; m; ) score[PopLowestBit(m)] += v;
+}
+
+int EvalDeltaScalar(const int8_t *score, int field, int v, uint64_t empty) {
+  int delta = 0;
+  for (uint64_t m = neighbour_mask[field] & empty; m; ) {
+    int s = score[PopLowestBit(m)];
+    delta += FieldValue(s + v) - FieldValue(s);
+  }
+  return delta;
+}
+
+int SumEmptyScoresScalar(const int8_t *score, uint64_t empty) {
+  int sum = 0;
+  for (uint64_t m = empty; m; ) sum += FieldValue(score[PopLowestBit(m)]);
+  return sum;
+}
+
+#if __x86_64__
+
+__attribute__((target("sse4.1")))
+void AddToNeighboursSse4(int8_t *score, int field, int v) {
+  static_assert(NUM_FIELDS <= 48, "score vector must fit in 3 registers");
+  const __m128i vv = _mm_set1_epi8(v);
+  const int8_t *mask = neighbour_byte_mask[field];
+  for (int i = 0; i < 48; i += 16) {
+    __m128i *p = reinterpret_cast<__m128i*>(score + i);
+    __m128i m = _mm_load_si128(reinterpret_cast<const __m128i*>(mask + i));
+    _mm_storeu_si128(p, _mm_add_epi8(_mm_loadu_si128(p), _mm_and_si128(vv, m)));
+  }
+}
+
+// Expands bits 8*k..8*k+15 of the broadcasted mask to bytes lanes, as -1 for
+// set bits and 0 for clear bits.
+__attribute__((target("sse4.1")))
+inline __m128i ExpandBitsSse4(__m128i bits, int k) {
+  const __m128i select = _mm_set1_epi64x(0x8040201008040201LL);
+  const __m128i shuffle = _mm_set_epi8(
+      k + 1, k + 1, k + 1, k + 1, k + 1, k + 1, k + 1, k + 1,
+      k, k, k, k, k, k, k, k);
+  __m128i bytes = _mm_and_si128(_mm_shuffle_epi8(bits, shuffle), select);
+  return _mm_cmpeq_epi8(bytes, select);
+}
+
+__attribute__((target("sse4.1")))
+inline __m128i FieldValueSse4(__m128i s) {
+  return _mm_add_epi8(s, _mm_sign_epi8(_mm_set1_epi8(5), s));
+}
+
+// Sums signed bytes by biasing them to unsigned and using psadbw, and adds the
+// result to the two 64-bit partial sums in `sum`. Each partial sum is biased by
+// 8*128 per call.
+__attribute__((target("sse4.1")))
+inline __m128i AddSumOfBytesSse4(__m128i sum, __m128i x) {
+  x = _mm_sad_epu8(_mm_xor_si128(x, _mm_set1_epi8(-128)), _mm_setzero_si128());
+  return _mm_add_epi64(sum, x);
+}
+
+__attribute__((target("sse4.1")))
+int EvalDeltaSse4(const int8_t *score, int field, int v, uint64_t empty) {
+  const __m128i bits = _mm_set1_epi64x(empty);
+  const __m128i vv = _mm_set1_epi8(v);
+  const int8_t *mask = neighbour_byte_mask[field];
+  __m128i sum = _mm_setzero_si128();
+  for (int i = 0; i < 48; i += 16) {
+    __m128i m = _mm_load_si128(reinterpret_cast<const __m128i*>(mask + i));
+    m = _mm_and_si128(m, ExpandBitsSse4(bits, i/8));
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(score + i));
+    __m128i t = _mm_add_epi8(s, _mm_and_si128(vv, m));
+    __m128i d = _mm_sub_epi8(FieldValueSse4(t), FieldValueSse4(s));
+    sum = AddSumOfBytesSse4(sum, _mm_and_si128(d, m));
+  }
+  return _mm_cvtsi128_si32(sum) + _mm_extract_epi32(sum, 2) - 128*48;
+}
+
+__attribute__((target("sse4.1")))
+int SumEmptyScoresSse4(const int8_t *score, uint64_t empty) {
+  const __m128i bits = _mm_set1_epi64x(empty);
+  __m128i sum = _mm_setzero_si128();
+  for (int i = 0; i < 48; i += 16) {
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(score + i));
+    sum = AddSumOfBytesSse4(sum, _mm_and_si128(FieldValueSse4(s), ExpandBitsSse4(bits, i/8)));
+  }
+  return _mm_cvtsi128_si32(sum) + _mm_extract_epi32(sum, 2) - 128*48;
+}
+
+// AVX2 versions of the functions above.
+
+__attribute__((target("avx2")))
+void AddToNeighboursAvx2(int8_t *score, int field, int v) {
+  const __m256i vv = _mm256_set1_epi8(v);
+  const int8_t *mask = neighbour_byte_mask[field];
+  for (int i = 0; i < SCORE_VECTOR_SIZE; i += 32) {
+    __m256i *p = reinterpret_cast<__m256i*>(score + i);
+    __m256i m = _mm256_load_si256(reinterpret_cast<const __m256i*>(mask + i));
+    _mm256_storeu_si256(p, _mm256_add_epi8(_mm256_loadu_si256(p), _mm256_and_si256(vv, m)));
+  }
+}
+
+__attribute__((target("avx2")))
+inline __m256i ExpandBitsAvx2(__m256i bits, int k) {
+  const __m256i select = _mm256_set1_epi64x(0x8040201008040201LL);
+  const __m256i shuffle = _mm256_set_epi8(
+      k + 3, k + 3, k + 3, k + 3, k + 3, k + 3, k + 3, k + 3,
+      k + 2, k + 2, k + 2, k + 2, k + 2, k + 2, k + 2, k + 2,
+      k + 1, k + 1, k + 1, k + 1, k + 1, k + 1, k + 1, k + 1,
+      k, k, k, k, k, k, k, k);
+  __m256i bytes = _mm256_and_si256(_mm256_shuffle_epi8(bits, shuffle), select);
+  return _mm256_cmpeq_epi8(bytes, select);
+}
+
+__attribute__((target("avx2")))
+inline __m256i FieldValueAvx2(__m256i s) {
+  return _mm256_add_epi8(s, _mm256_sign_epi8(_mm256_set1_epi8(5), s));
+}
+
+__attribute__((target("avx2")))
+inline __m256i AddSumOfBytesAvx2(__m256i sum, __m256i x) {
+  x = _mm256_sad_epu8(_mm256_xor_si256(x, _mm256_set1_epi8(-128)), _mm256_setzero_si256());
+  return _mm256_add_epi64(sum, x);
+}
+
+__attribute__((target("avx2")))
+inline int ReduceSumAvx2(__m256i sum) {
+  __m128i sum128 = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+  return _mm_cvtsi128_si32(sum128) + _mm_extract_epi32(sum128, 2) - 128*SCORE_VECTOR_SIZE;
+}
+
+__attribute__((target("avx2")))
+int EvalDeltaAvx2(const int8_t *score, int field, int v, uint64_t empty) {
+  const __m256i bits = _mm256_set1_epi64x(empty);
+  const __m256i vv = _mm256_set1_epi8(v);
+  const int8_t *mask = neighbour_byte_mask[field];
+  __m256i sum = _mm256_setzero_si256();
+  for (int i = 0; i < SCORE_VECTOR_SIZE; i += 32) {
+    __m256i m = _mm256_load_si256(reinterpret_cast<const __m256i*>(mask + i));
+    m = _mm256_and_si256(m, ExpandBitsAvx2(bits, i/8));
+    __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(score + i));
+    __m256i t = _mm256_add_epi8(s, _mm256_and_si256(vv, m));
+    __m256i d = _mm256_sub_epi8(FieldValueAvx2(t), FieldValueAvx2(s));
+    sum = AddSumOfBytesAvx2(sum, _mm256_and_si256(d, m));
+  }
+  return ReduceSumAvx2(sum);
+}
+
+__attribute__((target("avx2")))
+int SumEmptyScoresAvx2(const int8_t *score, uint64_t empty) {
+  const __m256i bits = _mm256_set1_epi64x(empty);
+  __m256i sum = _mm256_setzero_si256();
+  for (int i = 0; i < SCORE_VECTOR_SIZE; i += 32) {
+    __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(score + i));
+    sum = AddSumOfBytesAvx2(sum, _mm256_and_si256(FieldValueAvx2(s), ExpandBitsAvx2(bits, i/8)));
+  }
+  return ReduceSumAvx2(sum);
+}
+
+#endif  // __x86_64__
+
+void (*AddToNeighbours)(int8_t *score, int field, int v) = AddToNeighboursScalar;
+int (*EvalDelta)(const int8_t *score, int field, int v, uint64_t empty) = EvalDeltaScalar;
+int (*SumEmptyScores)(const int8_t *score, uint64_t empty) = SumEmptyScoresScalar;
+
+Kernels DetectKernels() {
+#if __x86_64__
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return Kernels::AVX2;
+  if (__builtin_cpu_supports("sse4.1")) return Kernels::SSE4;
+#endif
+  return Kernels::SCALAR;
+}
+
+// Selects the given kernels, falling back to slower ones if they are not
+// supported. Returns the selected kernels.
+Kernels SelectKernels(Kernels kernels) {
+  kernels = std::min(kernels, DetectKernels());
+  switch (kernels) {
+#if __x86_64__
+    case Kernels::AVX2:
+      AddToNeighbours = AddToNeighboursAvx2;
+      EvalDelta = EvalDeltaAvx2;
+      SumEmptyScores = SumEmptyScoresAvx2;
+      break;
+    case Kernels::SSE4:
+      AddToNeighbours = AddToNeighboursSse4;
+      EvalDelta = EvalDeltaSse4;
+      SumEmptyScores = SumEmptyScoresSse4;
+      break;
+#endif
+    default:
+      AddToNeighbours = AddToNeighboursScalar;
+      EvalDelta = EvalDeltaScalar;
+      SumEmptyScores = SumEmptyScoresScalar;
+      kernels = Kernels::SCALAR;
+  }
+  return kernels;
+}
+
 struct Move {
   int field;
   int value;
@@ -112,6 +644,107 @@ bool operator<(const Move &a, const Move &b) {
   return a.field < b.field || (a.field == b.field && a.value < b.value);
 }
 
+// A vector with a fixed capacity, stored inline, so that it can live on the
+// stack. The search uses these instead of std::vector, to avoid heap
+// allocations while selecting a move.
+template<class T, int N>
+class FixedVector {
+public:
+  int size() const { return count; }
+  bool empty() const { return count == 0; }
+  void clear() { count = 0; }
+
+  void push_back(const T &value) {
+    assert(count < N);
+    items[count++] = value;
+  }
+
+  T &operator[](int i) { return items[i]; }
+  const T &operator[](int i) const { return items[i]; }
+
+  T *begin() { return items; }
+  T *end() { return items + count; }
+  const T *begin() const { return items; }
+  const T *end() const { return items + count; }
+
+private:
+  int count = 0;
+  T items[N];
+};
+
+// Fields to search, in order (see CalculateFieldsToSearch()).
+typedef FixedVector<int, NUM_FIELDS> FieldList;
+
+// All moves of a state: a value on an empty field.
+typedef FixedVector<Move, NUM_FIELDS*MAX_VALUE> MoveList;
+
+// Returns the bitmask of values to search for a move by the given player on the
+// given empty field (see ValueMode). `empty` must be EmptyFields(state).
+//
+// Dominance: the outcome of the game can only improve for a player if the
+// scores of the empty fields change in their favour, or if their remaining
+// values are replaced by higher ones (since every move could be played the
+// same way, with a higher value). So if the field has no empty neighbours,
+// the value placed on it affects no score, and playing the lowest value
+// dominates playing any other value, since it leaves the highest values.
+inline unsigned ValuesToSearch(const State &state, int player, uint64_t empty, int field) {
+  const unsigned values = UnusedValues(state, player);
+  switch (value_mode) {
+    case ValueMode::TOP:
+      return 1u << HighestBit(values);
+    case ValueMode::ALL:
+      return values;
+    case ValueMode::DOMINANCE:
+      if ((neighbour_mask[field] & empty) == 0) return values & -values;
+      return values;
+  }
+  return values;
+}
+
+// Returns the Zobrist hash of the image of the state under symmetry s. For
+// s = 0 (the identity) this equals state.hash.
+uint64_t SymmetricHash(const State &state, int s) {
+  uint64_t hash = 0;
+  for (uint64_t m = state.occupied; m; ) {
+    const int field = PopLowestBit(m);
+    hash ^= zobrist(symmetries.Map(s, field), state.value[field]);
+  }
+  return hash;
+}
+
+// Returns the lowest hash of the images of the state under all symmetries, so
+// that symmetric states have the same canonical hash. If symmetry is not null,
+// *symmetry is set to the symmetry that maps the state to its canonical image.
+uint64_t CanonicalHash(const State &state, int *symmetry = nullptr) {
+  uint64_t best_hash = state.hash;
+  int best = 0;
+  for (int s = 1; s < 6; ++s) {
+    const uint64_t hash = SymmetricHash(state, s);
+    if (hash < best_hash) {
+      best_hash = hash;
+      best = s;
+    }
+  }
+  if (symmetry) *symmetry = best;
+  return best_hash;
+}
+
+// Returns a bitmask of the symmetries that map the state onto itself. Bit 0
+// (the identity) is always set.
+unsigned StateSymmetries(const State &state) {
+  unsigned result = 1;
+  for (int s = 1; s < 6; ++s) {
+    if (symmetries.MapMask(s, state.occupied) != state.occupied) continue;
+    bool symmetric = true;
+    for (uint64_t m = state.occupied; symmetric && m; ) {
+      const int field = PopLowestBit(m);
+      symmetric = state.value[symmetries.Map(s, field)] == state.value[field];
+    }
+    if (symmetric) result |= 1u << s;
+  }
+  return result;
+}
+
 State *debug_state;
 
 struct DebugStateSwapper {
@@ -188,8 +821,11 @@ int64_t GetCpuTimeNanos() {
   return NANOS_PER_SECOND*tv.tv_sec + tv.tv_nsec;
 }
 
+// Returns a static buffer, so the result is only valid until the next call on
+// the same thread. The buffer is per thread, since moves are formatted
+// concurrently by batch workers (see RunBatch()) and YBWC workers.
 const char *FormatMove(const Move &move) {
-  static char buf[32];
+  static thread_local char buf[32];
   int u = 0, v = move.field;
   while (v >= SIZE - u) {
     v -= SIZE - u;
@@ -202,8 +838,10 @@ const char *FormatMove(const Move &move) {
 }
 
 void MakeHole(State &state, int field) {
-  CHECK(!state.occupied[field]);
-  state.occupied[field] = true;
+  CHECK(!IsOccupied(state, field));
+  state.eval -= FieldValue(state.score[field]);
+  state.occupied |= uint64_t{1} << field;
+  state.hash ^= zobrist(field, 0);
 }
 
 inline bool IsGameOver(const State &state) {
@@ -218,19 +856,26 @@ inline int GetNextPlayer(const State &state) {
 bool IsValidMove(const State &state, const Move &move) {
   const int player = GetNextPlayer(state);
   return
-      move.field >= 0 && move.field < NUM_FIELDS && !state.occupied[move.field] &&
-      move.value >= 1 && move.value <= MAX_VALUE && !state.used[player][move.value];
+      move.field >= 0 && move.field < NUM_FIELDS && !IsOccupied(state, move.field) &&
+      move.value >= 1 && move.value <= MAX_VALUE && !IsUsed(state, player, move.value);
 }
 
 void DoMove(State &state, const Move &move) {
   assert(IsValidMove(state, move));
-  state.occupied[move.field] = true;
+  state.occupied |= uint64_t{1} << move.field;
   const int player = GetNextPlayer(state);
-  state.used[player][move.value] = true;
+  state.used[player] |= 1u << move.value;
   int v = player == 0 ? move.value : -move.value;
   state.value[move.field] = v;
-  const int *ip = neighbours[move.field];
-  for (int i; (i = *ip) >= 0; ++ip) state.score[i] += v;
+  state.hash ^= zobrist(move.field, v);
+  // If the field has no empty neighbours (see GenerateFieldValues()), the
+  // stone changes no score that counts towards the evaluation.
+  const uint64_t empty = EmptyFields(state);
+  if (neighbour_mask[move.field] & empty) {
+    state.eval += EvalDelta(state.score, move.field, v, empty);
+  }
+  state.eval -= FieldValue(state.score[move.field]);
+  AddToNeighbours(state.score, move.field, v);
   ++state.moves_played;
 }
 
@@ -239,14 +884,19 @@ void UndoMove(State &state, const Move &move) {
   --state.moves_played;
   const int player = GetNextPlayer(state);
   int v = player == 0 ? move.value : -move.value;
-  const int *ip = neighbours[move.field];
-  for (int i; (i = *ip) >= 0; ++ip) state.score[i] -= v;
+  const uint64_t empty = EmptyFields(state);
+  if (neighbour_mask[move.field] & empty) {
+    state.eval += EvalDelta(state.score, move.field, -v, empty);
+  }
+  state.eval += FieldValue(state.score[move.field]);
+  AddToNeighbours(state.score, move.field, -v);
   assert(state.value[move.field] == v);
   state.value[move.field] = 0;
-  assert(state.used[player][move.value]);
-  state.used[player][move.value] = false;
-  assert(state.occupied[move.field]);
-  state.occupied[move.field] = false;
+  state.hash ^= zobrist(move.field, v);
+  assert(IsUsed(state, player, move.value));
+  state.used[player] &= ~(1u << move.value);
+  assert(IsOccupied(state, move.field));
+  state.occupied &= ~(uint64_t{1} << move.field);
 }
 
 int DecodeBase36Char(char ch) {
@@ -291,12 +941,12 @@ bool IsValidState(const State &state, const vector<Move> &history, string *reaso
   int blue_stones = 0;
   for (int field = 0; field < NUM_FIELDS; ++field) {
     int v = state.value[field];
-    if (state.occupied[field]) {
+    if (IsOccupied(state, field)) {
       if (v > 0) {
         ++red_stones;
-        EXPECT(state.used[0][v], "unused red value field=%d v=%d", field, v);
+        EXPECT(IsUsed(state, 0, v), "unused red value field=%d v=%d", field, v);
       } else if (v < 0) {
-        EXPECT(state.used[1][-v], "unused blue value field=%d v=%d", field, -v);
+        EXPECT(IsUsed(state, 1, -v), "unused blue value field=%d v=%d", field, -v);
         ++blue_stones;
       } else {
         ++initial_stones;
@@ -313,12 +963,29 @@ bool IsValidState(const State &state, const vector<Move> &history, string *reaso
   EXPECT(red_stones == blue_stones || red_stones == blue_stones + 1,
       "red_stones=%d blue_stones=%d", red_stones, blue_stones);
 
-  int red_values_used = 0;
-  int blue_values_used = 0;
-  for (int i = 1; i <= MAX_VALUE; ++i) {
-    if (state.used[0][i]) ++red_values_used;
-    if (state.used[1][i]) ++blue_values_used;
+  uint64_t hash = 0;
+  for (int field = 0; field < NUM_FIELDS; ++field) {
+    if (IsOccupied(state, field)) hash ^= zobrist(field, state.value[field]);
+  }
+  for (int field = 0; field < SCORE_VECTOR_SIZE; ++field) {
+    int score = 0;
+    if (field < NUM_FIELDS) {
+      for (uint64_t m = neighbour_mask[field]; m; ) score += state.value[PopLowestBit(m)];
+    }
+    EXPECT(state.score[field] == score, "field=%d score=%d expected=%d",
+        field, state.score[field], score);
   }
+  int eval = SumEmptyScores(state.score, EmptyFields(state));
+  EXPECT(state.eval == eval, "eval=%d expected=%d", state.eval, eval);
+  EXPECT(state.hash == hash, "hash=%016llx expected=%016llx",
+      (unsigned long long)state.hash, (unsigned long long)hash);
+
+  EXPECT((state.occupied & ~ALL_FIELDS) == 0, "occupied=%016llx",
+      (unsigned long long)state.occupied);
+  EXPECT((state.used[0] & ~ALL_VALUES) == 0 && (state.used[1] & ~ALL_VALUES) == 0,
+      "used[0]=%04x used[1]=%04x", state.used[0], state.used[1]);
+  int red_values_used = PopCount(state.used[0]);
+  int blue_values_used = PopCount(state.used[1]);
   EXPECT(red_values_used == red_stones,
       "red_values_used=%d red_stones=%d", red_values_used, red_stones);
   EXPECT(blue_values_used == blue_stones,
@@ -331,16 +998,16 @@ bool IsValidState(const State &state, const vector<Move> &history, string *reaso
   for (int i = 0; i < static_cast<int>(history.size()); ++i) {
     int field = history[i].field;
     int value = history[i].value;
-    EXPECT(state.occupied[field], "not occupied i=%d field=%d", i, field);
+    EXPECT(IsOccupied(state, field), "not occupied i=%d field=%d", i, field);
     if (i < INITIAL_STONES) {
       EXPECT(state.value[field] == 0, "not empty i=%d field=%d", i, field);
     } else if (((i - INITIAL_STONES) & 1) == 0) {
-      EXPECT(state.used[0][value], "red stone not used i=%d value=%d", i, value);
+      EXPECT(IsUsed(state, 0, value), "red stone not used i=%d value=%d", i, value);
       EXPECT(state.value[field] == value,
           "invalid red field i=%d field=%d expected value=%d actual value=%d",
           i, field, value, state.value[field]);
     } else {
-      EXPECT(state.used[1][value], "blue stone not used i=%d value=%d", i, value);
+      EXPECT(IsUsed(state, 1, value), "blue stone not used i=%d value=%d", i, value);
       EXPECT(state.value[field] == -value,
           "invalid blue field i=%d field=%d expected value=%d actual value=%d",
           i, field, value, state.value[field]);
@@ -350,10 +1017,10 @@ bool IsValidState(const State &state, const vector<Move> &history, string *reaso
   return true;
 }
 
-template<class T, int N>
-void DumpArray(const T (&a)[N], FILE *fp) {
+template<class T>
+void DumpArray(const T *a, int n, FILE *fp) {
   fputc('{', fp);
-  for (int i = 0; i < N; ++i) {
+  for (int i = 0; i < n; ++i) {
     if (i > 0) fputc(',', fp);
     fprintf(fp, "%d", int{a[i]});
   }
@@ -363,15 +1030,17 @@ void DumpArray(const T (&a)[N], FILE *fp) {
 void DumpState(const State &state, FILE *fp) {
   fprintf(fp, "state.moves_played=%d", state.moves_played);
   for (int i = 0; i < 2; ++i) {
-    fprintf(fp, "\nstate.used[%d]=", i);
-    DumpArray(state.used[i], fp);
+    fprintf(fp, "\nstate.used[%d]=%04x", i, state.used[i]);
   }
-  fputs("\nstate.occupied=", fp);
-  DumpArray(state.occupied, fp);
+  fprintf(fp, "\nstate.occupied=%09llx", (unsigned long long)state.occupied);
+  fprintf(fp, "\nstate.hash=%016llx", (unsigned long long)state.hash);
+  int symmetry = 0;
+  uint64_t canonical_hash = CanonicalHash(state, &symmetry);
+  fprintf(fp, "\ncanonical_hash=%016llx (symmetry %d)", (unsigned long long)canonical_hash, symmetry);
   fputs("\nstate.value=", fp);
-  DumpArray(state.value, fp);
+  DumpArray(state.value, NUM_FIELDS, fp);
   fputs("\nstate.score=", fp);
-  DumpArray(state.value, fp);
+  DumpArray(state.score, NUM_FIELDS, fp);
   fputc('\n', fp);
 }
 
@@ -385,125 +1054,1781 @@ void Validate(const State &state, const vector<Move> &history) {
   }
 }
 
+// Returns the sum of the scores of empty fields, with a bonus of 5 points for
+// each field that is (currently) won by a player. The sum is maintained
+// incrementally by DoMove() and UndoMove().
 int Evaluate(State &state) {
-  int score = 0;
-  for (int f = 0; f < NUM_FIELDS; ++f) {
-    if (state.occupied[f]) continue;
-    score += state.score[f] + (
-        state.score[f] > 0 ? +5 :
-        state.score[f] < 0 ? -5 : 0);
-  }
+  int score = state.eval;
+  assert(score == SumEmptyScores(state.score, EmptyFields(state)));
   return GetNextPlayer(state) == 0 ? score : -score;
 }
 
-// Negamax depth-first search with alpha-beta pruning.
+// Returns the value of Evaluate() after the given move, from the perspective of
+// the player making the move, without actually executing the move.
+int EvaluateMove(const State &state, const Move &move) {
+  const int player = GetNextPlayer(state);
+  const int v = player == 0 ? move.value : -move.value;
+  const uint64_t empty = EmptyFields(state);
+  int score = state.eval - FieldValue(state.score[move.field]);
+  if (neighbour_mask[move.field] & empty) score += EvalDelta(state.score, move.field, v, empty);
+  return player == 0 ? score : -score;
+}
+
+// Type of value stored in a transposition table entry, using the same
+// conventions as Search(): an upper bound is the result of a search that failed
+// low, and a lower bound is the result of a search that failed high.
+enum Bound { BOUND_NONE = 0, BOUND_UPPER = 1, BOUND_LOWER = 2, BOUND_EXACT = 3 };
+
+struct TTEntry {
+  int value;
+  int depth;
+  Bound bound;
+  Move move;  // move.field is -1 if there is no best move
+};
+
+// Packs an entry into the lower 48 bits of a word, for the hash tables below.
+inline uint64_t PackEntry(int depth, int value, Bound bound, const Move &move) {
+  return uint64_t{static_cast<uint16_t>(value)} |
+      uint64_t{static_cast<uint8_t>(depth)} << 16 |
+      uint64_t{static_cast<uint8_t>(bound)} << 24 |
+      uint64_t{static_cast<uint8_t>(move.field)} << 32 |
+      uint64_t{static_cast<uint8_t>(move.value)} << 40;
+}
+
+inline void UnpackEntry(uint64_t data, TTEntry *entry) {
+  entry->value = static_cast<int16_t>(data);
+  entry->depth = static_cast<uint8_t>(data >> 16);
+  entry->bound = static_cast<Bound>(static_cast<uint8_t>(data >> 24));
+  entry->move.field = static_cast<int8_t>(data >> 32);
+  entry->move.value = static_cast<uint8_t>(data >> 40);
+}
+
+// Fixed-size hash table of search results, indexed by the Zobrist hash of the
+// state. Entries are replaced when the new result was searched at least as
+// deep as the old one, or when the old entry belongs to a different state.
 //
-// If the result is in [lo,hi] (excluding the boundaries), the value is exact.
-// If the result is less than or equal to lo, or greater than or equal to hi,
-// then it is an upper or lower bound on the true value, respectively.
-int Search(State &state, int depth, int lo, int hi, vector<Move> *best_moves,
-    const vector<int> &fields_to_search) {
-  assert(lo < hi);  // invariant maintained throughout this function
+// The table is shared between search threads without locking. Each slot
+// consists of two words: the packed entry data, and the key XOR-ed with the
+// data. A slot that was torn by concurrent writes fails the key check on probe,
+// so it is treated as a miss instead of returning corrupted data.
+class TranspositionTable {
+public:
+  void Resize(int64_t size_bytes) {
+    table.clear();
+    mask = 0;
+    if (size_bytes < (int64_t)sizeof(Slot)) return;
+    size_t size = 1;
+    while (2*size*sizeof(Slot) <= (uint64_t)size_bytes) size *= 2;
+    table.assign(size, Slot{});
+    mask = size - 1;
+  }
 
-  // TODO: disable this in non-debug mode?
-  ++counter_search.at(depth);
+  bool Enabled() const { return !table.empty(); }
 
-  if (depth == 0) {
-    assert(!best_moves);
-    return Evaluate(state);
+  void Clear() { std::fill(table.begin(), table.end(), Slot{}); }
+
+  // Returns true and fills in *entry if the table contains an entry for key.
+  bool Probe(uint64_t key, TTEntry *entry) const {
+    const Slot &slot = table[key & mask];
+    uint64_t data = __atomic_load_n(&slot.data, __ATOMIC_RELAXED);
+    uint64_t check = __atomic_load_n(&slot.check, __ATOMIC_RELAXED);
+    if (data == 0 || (check ^ data) != key) return false;
+    UnpackEntry(data, entry);
+    return true;
   }
 
-  assert(!IsGameOver(state));  // caller should make sure depth is limited
+  void Store(uint64_t key, int depth, int value, Bound bound, const Move &move) {
+    Slot &slot = table[key & mask];
+    uint64_t old_data = __atomic_load_n(&slot.data, __ATOMIC_RELAXED);
+    uint64_t old_check = __atomic_load_n(&slot.check, __ATOMIC_RELAXED);
+    if ((old_check ^ old_data) == key && static_cast<uint8_t>(old_data >> 16) > depth) return;
+    uint64_t data = PackEntry(depth, value, bound, move);
+    __atomic_store_n(&slot.data, data, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot.check, key ^ data, __ATOMIC_RELAXED);
+  }
 
-  int best_value = INT_MIN;
+private:
+  struct Slot {
+    uint64_t data;
+    uint64_t check;
+  };
 
-  const bool debug_print = best_moves != nullptr;
-  const int player = GetNextPlayer(state);
-  for (int value = MAX_VALUE; value > 0; --value) {
-    if (state.used[player][value]) continue;
-    for (int field : fields_to_search) {
-      if (state.occupied[field]) continue;
-      Move move = {field, value};
-      DoMove(state, move);
-      int value = -Search(state, depth - 1, -hi, -lo, nullptr, fields_to_search);
-      UndoMove(state, move);
-      if (debug_print) fprintf(stderr, " %s:%d", FormatMove(move), value);
-      if (best_moves && value >= best_value) {
-        if (value > best_value) best_moves->clear();
-        best_moves->push_back(move);
+  vector<Slot> table;
+  uint64_t mask = 0;
+};
+
+TranspositionTable tt;
+
+// Exact results of the endgame solver, indexed by EndgameKey(). Unlike the
+// main transposition table, positions that differ only in the values of
+// occupied fields share an entry here.
+TranspositionTable endgame_table;
+
+// Persistent cache of search results in a memory-mapped file (see --cache). It
+// is shared by all player processes on the host that use the same file, so that
+// positions searched in earlier runs or in concurrent games become lookups.
+//
+// The file consists of a header page followed by buckets of four slots. Slots
+// are read and updated without locking, like those of TranspositionTable, which
+// works the same between processes as between threads. The upper 16 bits of
+// each entry hold the generation of the process that stored it, which is taken
+// from a counter in the header that each process increments when opening the
+// file. A new entry replaces the entry for the same state in its bucket if it
+// was searched at least as deep, and otherwise the entry with the lowest depth
+// minus age, so that deep results are kept, while stale ones make room.
+class AnalysisCache {
+public:
+  static const uint64_t MAGIC = 0x3245484341434853ULL;  // "SHCACHE2"
+
+  ~AnalysisCache() { Close(); }
+
+  bool Enabled() const { return buckets != nullptr; }
+
+  // Opens the cache file, or creates it with the given size if it does not
+  // exist. An existing file keeps its size.
+  bool Open(const char *path, int64_t size_bytes) {
+    Close();
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return false;
+    // The header is checked or initialized while holding an exclusive lock, so
+    // that processes creating the file at the same time do not race.
+    flock(fd, LOCK_EX);
+    struct stat st;
+    bool created = false;
+    size = 0;
+    if (fstat(fd, &st) == 0) {
+      if (st.st_size == 0) {
+        uint64_t num_buckets = 1;
+        while (2*num_buckets*sizeof(Bucket) <= (uint64_t)size_bytes) num_buckets *= 2;
+        created = ftruncate(fd, HEADER_SIZE + num_buckets*sizeof(Bucket)) == 0;
+        if (created) size = HEADER_SIZE + num_buckets*sizeof(Bucket);
+      } else {
+        size = st.st_size;
       }
-      if (value > best_value) {
-        best_value = value;
-        if (best_value > lo) {
-          if (best_value >= hi) goto beta_cutoff;
-          lo = best_value;
-          // This is necessary to get all best moves. Otherwise, future values
-          // equal to best_value are only upper bounds, and only the first
-          // element of best_moves is guaranteed to be a "best" move.
-          if (best_moves) --lo;
-        }
+      if (size > HEADER_SIZE && (size - HEADER_SIZE) % sizeof(Bucket) == 0) {
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
       }
     }
-    if (always_play_top_value) break;
+    if (data != MAP_FAILED && created) {
+      Header *header = GetHeader();
+      header->num_buckets = (size - HEADER_SIZE)/sizeof(Bucket);
+      header->magic = MAGIC;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    Header *header = GetHeader();
+    if (header->magic != MAGIC || header->num_buckets*sizeof(Bucket) != size - HEADER_SIZE ||
+        (header->num_buckets & (header->num_buckets - 1)) != 0) {
+      Close();
+      return false;
+    }
+    madvise(data, size, MADV_RANDOM);
+    buckets = reinterpret_cast<Bucket*>(static_cast<char*>(data) + HEADER_SIZE);
+    mask = header->num_buckets - 1;
+    generation = static_cast<uint16_t>(__atomic_add_fetch(&header->generation, 1, __ATOMIC_RELAXED));
+    // Results depend on the values searched, so each value mode has its own keys.
+    salt = 0x9e3779b97f4a7c15ULL*static_cast<uint64_t>(value_mode);
+    return true;
   }
-beta_cutoff:
-  if (debug_print) fputc('\n', stderr);
-  return best_value;
-}
 
-// Only search fields that are unoccupied, and order them by decreasing number
-// of liberties (i.e. number of unoccupied neighbouring fields). This means the
-// best fields appear first, which improves the beta-cutoff rate.
-vector<int> CalculateFieldsToSearch(const State &state) {
-  vector<int> fields;
-  int liberties[NUM_FIELDS] = {};
-  for (int field = 0; field < NUM_FIELDS; ++field) {
-    if (!state.occupied[field]) {
-      fields.push_back(field);
-      const int *fp = neighbours[field];
-      for (int f; (f = *fp) >= 0; ++fp) {
-        liberties[field] += !state.occupied[f];
+  void Close() {
+    if (data != MAP_FAILED) munmap(data, size);
+    data = MAP_FAILED;
+    buckets = nullptr;
+  }
+
+  // Returns true and fills in *entry if the cache contains an entry for the
+  // state. Entries are keyed by CanonicalHash(), so that symmetric states share
+  // them, and their moves are stored for the canonical image of the state.
+  bool Probe(const State &state, TTEntry *entry) const {
+    int symmetry = 0;
+    const uint64_t key = CanonicalHash(state, &symmetry) ^ salt;
+    for (const Slot &slot : buckets[key & mask].slots) {
+      uint64_t data = __atomic_load_n(&slot.data, __ATOMIC_RELAXED);
+      uint64_t check = __atomic_load_n(&slot.check, __ATOMIC_RELAXED);
+      if (data != 0 && (check ^ data) == key) {
+        UnpackEntry(data, entry);
+        if (entry->move.field >= 0) {
+          entry->move.field = symmetries.Unmap(symmetry, entry->move.field);
+        }
+        return true;
       }
     }
+    return false;
   }
-  if (enable_move_ordering) {
-    std::random_shuffle(fields.begin(), fields.end());
-    std::stable_sort(fields.begin(), fields.end(), [&liberties](int f, int g) {
-      return liberties[f] > liberties[g];
-    });
+
+  void Store(const State &state, int depth, int value, Bound bound, Move move) {
+    int symmetry = 0;
+    const uint64_t key = CanonicalHash(state, &symmetry) ^ salt;
+    if (move.field >= 0) move.field = symmetries.Map(symmetry, move.field);
+    Slot *victim = nullptr;
+    int victim_score = INT_MAX;
+    for (Slot &slot : buckets[key & mask].slots) {
+      uint64_t old_data = __atomic_load_n(&slot.data, __ATOMIC_RELAXED);
+      uint64_t old_check = __atomic_load_n(&slot.check, __ATOMIC_RELAXED);
+      const int old_depth = static_cast<uint8_t>(old_data >> 16);
+      if (old_data != 0 && (old_check ^ old_data) == key) {
+        if (old_depth > depth) return;
+        victim = &slot;
+        break;
+      }
+      const int age = static_cast<uint16_t>(generation - (old_data >> 48));
+      const int score = old_data == 0 ? INT_MIN : old_depth - age;
+      if (score < victim_score) {
+        victim = &slot;
+        victim_score = score;
+      }
+    }
+    uint64_t data = PackEntry(depth, value, bound, move) | uint64_t{generation} << 48;
+    __atomic_store_n(&victim->data, data, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->check, key ^ data, __ATOMIC_RELAXED);
   }
-  return fields;
-}
 
-Move SelectMove(State &state) {
-  int64_t cpu_time_nanos = GetCpuTimeNanos();
-  int64_t wall_time_nanos = GetWallTimeNanos();
+private:
+  static const size_t HEADER_SIZE = 4096;
+
+  struct Header {
+    uint64_t magic;
+    uint64_t num_buckets;
+    uint64_t generation;
+  };
+
+  struct Slot {
+    uint64_t data;
+    uint64_t check;
+  };
+
+  struct Bucket {
+    Slot slots[4];
+  };
+
+  Header *GetHeader() { return static_cast<Header*>(data); }
+
+  void *data = MAP_FAILED;
+  size_t size = 0;
+  Bucket *buckets = nullptr;
+  uint64_t mask = 0;
+  uint16_t generation = 0;
+  uint64_t salt = 0;
+};
 
-  DebugStateSwapper setter(state);
+AnalysisCache cache;
 
-  Move best_move;
-  const vector<int> fields = CalculateFieldsToSearch(state);
-  const int moves_left = MAX_MOVES - state.moves_played;
-  int64_t total_evals = 0;
-  int search_depth = min_search_depth;
-  for (;;) {
-    int d = std::min(search_depth, moves_left);
-    counter_search.assign(d + 1, 0);
+// Minimum remaining depth of the nodes that are looked up in and stored to the
+// analysis cache. Shallower nodes are cheap to search, and would only evict
+// more valuable entries.
+const int min_cache_depth = 4;
 
-    vector<Move> best_moves;
-    int value = Search(state, d, -1000, +1000, &best_moves, fields);
-    CHECK(!best_moves.empty());
-    // Always return the best move with the lowest field index. This seems to
+// Search statistics are only collected if SEARCH_COUNTERS is nonzero, which
+// is the default in debug builds. Otherwise, all counting compiles to nothing.
+#ifndef SEARCH_COUNTERS
+#ifdef DEBUG
+#define SEARCH_COUNTERS 1
+#else
+#define SEARCH_COUNTERS 0
+#endif
+#endif
+
+template<bool enabled> struct SearchCounters;
+
+// Disabled search counters: all methods are no-ops.
+template<> struct SearchCounters<false> {
+  static const bool ENABLED = false;
+
+  void Clear() {}
+  void Add(const SearchCounters&) {}
+  void CountNode(int) {}
+  void CountNodes(int, int) {}
+  void CountCutoff(int) {}
+  void CountProbe(bool) {}
+  void CountProbeCutoff() {}
+  int64_t Nodes(int) const { return 0; }
+  void Print(int, FILE *) const {}
+  string FormatJson(int) const { return string(); }
+};
+
+// Enabled search counters, collected per thread for each iteration of the
+// iterative deepening search.
+template<> struct SearchCounters<true> {
+  static const bool ENABLED = true;
+
+  // Beta cutoffs are counted by the index of the move that caused them; moves
+  // with index CUTOFF_BUCKETS - 1 or higher share the last bucket.
+  static const int CUTOFF_BUCKETS = 8;
+
+  int64_t nodes[MAX_MOVES + 1];  // indexed by remaining depth; [0] counts leaves
+  int64_t cutoffs[CUTOFF_BUCKETS];
+  int64_t probes;  // transposition table, endgame table and cache lookups
+  int64_t hits;  // lookups that found an entry
+  int64_t probe_cutoffs;  // lookups that returned a value
+
+  SearchCounters() { Clear(); }
+
+  void Clear() { memset(this, 0, sizeof(*this)); }
+
+  void Add(const SearchCounters &other) {
+    for (int i = 0; i <= MAX_MOVES; ++i) nodes[i] += other.nodes[i];
+    for (int i = 0; i < CUTOFF_BUCKETS; ++i) cutoffs[i] += other.cutoffs[i];
+    probes += other.probes;
+    hits += other.hits;
+    probe_cutoffs += other.probe_cutoffs;
+  }
+
+  void CountNode(int depth) { ++nodes[depth]; }
+
+  void CountNodes(int depth, int n) { nodes[depth] += n; }
+
+  void CountCutoff(int move_index) { ++cutoffs[std::min(move_index, CUTOFF_BUCKETS - 1)]; }
+
+  void CountProbe(bool hit) {
+    ++probes;
+    hits += hit;
+  }
+
+  void CountProbeCutoff() { ++probe_cutoffs; }
+
+  int64_t Nodes(int depth) const { return nodes[depth]; }
+
+  int64_t TotalCutoffs() const {
+    int64_t total = 0;
+    for (int i = 0; i < CUTOFF_BUCKETS; ++i) total += cutoffs[i];
+    return total;
+  }
+
+  // Geometric mean of the ratio of nodes between successive plies.
+  double EffectiveBranchingFactor(int depth) const {
+    if (depth == 0 || nodes[depth] == 0) return 0;
+    return pow(static_cast<double>(nodes[0])/nodes[depth], 1.0/depth);
+  }
+
+  // Effective branching factor of the given ply below the root (1-based) of a
+  // search to the given depth: the ratio of the nodes at that ply to those at
+  // the ply above it.
+  double PlyBranchingFactor(int depth, int ply) const {
+    const int64_t parents = nodes[depth - ply + 1];
+    return parents == 0 ? 0 : static_cast<double>(nodes[depth - ply])/parents;
+  }
+
+  double FirstCutoffRate() const {
+    return static_cast<double>(cutoffs[0])/std::max<int64_t>(TotalCutoffs(), 1);
+  }
+
+  double HitRate() const {
+    return static_cast<double>(hits)/std::max<int64_t>(probes, 1);
+  }
+
+  // Prints the counters of a search to the given depth for the log: nodes per
+  // remaining depth, followed by summary statistics. This is written directly
+  // to the stream, since it is called while selecting a move.
+  void Print(int depth, FILE *fp) const {
+    for (int i = 0; i <= depth; ++i) fprintf(fp, " %lld", (long long)nodes[i]);
+    fprintf(fp, " ebf=%.2f (", EffectiveBranchingFactor(depth));
+    for (int ply = 1; ply <= depth; ++ply) {
+      fprintf(fp, ply > 1 ? " %.1f" : "%.1f", PlyBranchingFactor(depth, ply));
+    }
+    fprintf(fp, ") cutoffs=%lld first=%.1f%% hits=%.1f%%",
+        (long long)TotalCutoffs(), 100*FirstCutoffRate(), 100*HitRate());
+  }
+
+  // Formats the counters as additional fields of a JSON object.
+  string FormatJson(int depth) const {
+    string result = ", \"nodes_by_depth\": [";
+    for (int i = 0; i <= depth; ++i) result += Sprintf(i ? ", %lld" : "%lld", (long long)nodes[i]);
+    result += Sprintf("], \"leaves\": %lld, \"ebf\": %.3f, \"ebf_by_ply\": [",
+        (long long)nodes[0], EffectiveBranchingFactor(depth));
+    for (int ply = 1; ply <= depth; ++ply) {
+      result += Sprintf(ply > 1 ? ", %.3f" : "%.3f", PlyBranchingFactor(depth, ply));
+    }
+    result += Sprintf("], \"cutoffs\": %lld, \"first_cutoff_rate\": %.4f, "
+        "\"probes\": %lld, \"hit_rate\": %.4f",
+        (long long)TotalCutoffs(), FirstCutoffRate(), (long long)probes, HitRate());
+    return result;
+  }
+};
+
+typedef SearchCounters<SEARCH_COUNTERS != 0> Counters;
+
+class YbwcPool;
+struct SplitPoint;
+
+// Per-thread search state.
+struct SearchContext {
+  // Search statistics of the current iteration (see SearchCounters).
+  Counters counters;
+
+  // Total number of nodes searched. This is read by other threads to calculate
+  // the aggregate number of nodes searched by all threads.
+  std::atomic<int64_t> nodes{0};
+
+  // Tables used by the search. All threads searching the same root share the
+  // global tables, while batch workers each use their own.
+  TranspositionTable *table = &tt;
+  TranspositionTable *endgame = &endgame_table;
+
+  // If not null, the search is aborted as soon as this becomes true.
+  const std::atomic<bool> *stop = nullptr;
+
+  // Node count at which IsStopped() next checks the search deadline.
+  int64_t next_deadline_check = 0;
+
+  // Set when the search was aborted. Results of an aborted search are invalid.
+  bool aborted = false;
+
+  // If not null, nodes are split between the threads of this pool (see
+  // YbwcPool below). pool_index is the index of this thread in the pool.
+  YbwcPool *pool = nullptr;
+  int pool_index = 0;
+
+  // The split point whose task this thread is currently executing, if any.
+  SplitPoint *split_point = nullptr;
+
+  // Killer moves: the last two moves that caused a beta cutoff, indexed by the
+  // number of moves played. Since killers are only used if they occur in the
+  // list of generated moves, they need not be valid.
+  Move killers[MAX_MOVES][2] = {};
+
+  // History scores: sum of depth^2 over the beta cutoffs caused by each move,
+  // indexed by field and value.
+  int history[NUM_FIELDS][MAX_VALUE + 1] = {};
+
+  void CountNode(int depth) {
+    counters.CountNode(depth);
+    nodes.store(nodes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  void CountNodes(int depth, int n) {
+    counters.CountNodes(depth, n);
+    nodes.store(nodes.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  // Records a move that caused a beta cutoff at the given depth.
+  void RecordCutoff(const State &state, const Move &move, int depth) {
+    Move *killer = killers[state.moves_played];
+    if (killer[0].field != move.field || killer[0].value != move.value) {
+      killer[1] = killer[0];
+      killer[0] = move;
+    }
+    history[move.field][move.value] += depth*depth;
+  }
+
+  // Called before each search from the root. Killers refer to the previous
+  // position, so they are cleared, while history scores are halved so that
+  // recent cutoffs weigh more heavily.
+  void AgeMoveOrdering() {
+    for (auto &killer : killers) killer[0] = killer[1] = Move{-1, 0};
+    for (auto &values : history) for (int &score : values) score >>= 1;
+  }
+
+  void ClearMoveOrdering() {
+    for (auto &killer : killers) killer[0] = killer[1] = Move{-1, 0};
+    for (auto &values : history) for (int &score : values) score = 0;
+  }
+};
+
+// Parallel search modes, used when num_threads > 1.
+//
+//  LAZY_SMP: helper threads search the same root independently, and share
+//  results only through the transposition table (see HelperSearch()).
+//
+//  YBWC: "Young Brothers Wait" concept. After the first child of a node has
+//  been searched, its remaining siblings are searched in parallel (see
+//  YbwcPool). This finds the same best moves as the sequential search.
+enum class ParallelMode { LAZY_SMP, YBWC };
+
+const char *parallel_mode_names[] = {"lazy", "ybwc"};
+
+ParallelMode parallel_mode = ParallelMode::LAZY_SMP;
+
+// Minimum remaining depth of a node for its children to be searched in
+// parallel. Below this, the overhead of splitting exceeds the benefit.
+const int min_split_depth = 4;
+
+// A node whose remaining children are being searched in parallel. It lives on
+// the stack of the thread that created it (the owner), which waits until all
+// tasks have finished before returning.
+struct SplitPoint {
+  SplitPoint *parent;  // split point of the task that created this one, if any
+  const State *state;  // not modified while tasks are outstanding
+  const FieldList *fields_to_search;
+  int depth;
+  int hi;
+
+  // Set when the node had a beta cutoff, to cancel the remaining tasks.
+  std::atomic<bool> cancelled{false};
+
+  // Search results, protected by mutex.
+  std::mutex mutex;
+  int lo;
+  int best_value;
+  Move best_move;
+  MoveList *best_moves;
+  int pending;  // number of tasks that have not finished yet
+
+  // Signalled when pending drops to 0, to wake up the owner.
+  std::condition_variable finished;
+};
+
+// Returns whether the given split point, or any of its ancestors, has been
+// cancelled. Results of searches under a cancelled split point are not used.
+bool IsCancelled(const SplitPoint *sp) {
+  for (; sp; sp = sp->parent) {
+    if (sp->cancelled.load(std::memory_order_relaxed)) return true;
+  }
+  return false;
+}
+
+// Deadline for the current search, in the clock returned by GetBudgetTimeNanos(),
+// or 0 if there is none. deadline_passed is set by the first thread that
+// notices the deadline has passed, which stops all search threads. Both are
+// read by all search threads, while SelectMove() changes them.
+std::atomic<int64_t> search_deadline_nanos{0};
+std::atomic<bool> deadline_passed{false};
+
+int64_t GetBudgetTimeNanos() {
+  return use_cpu_time ? GetCpuTimeNanos() : GetWallTimeNanos();
+}
+
+// Returns the time used so far in this game, as counted against game_time:
+// either CPU time, or wall time excluding time spent waiting for the opponent.
+int64_t GetGameTimeUsedNanos() {
+  return use_cpu_time ? GetCpuTimeNanos() :
+      GetWallTimeNanos() - wall_time_start_nanos - wall_time_suspended_nanos;
+}
+
+// Relative amount of time to spend on each of a player's 15 moves. The first
+// moves have few stones to interact with and are often in the opening book,
+// while the last moves are solved quickly by the endgame solver, so most time
+// goes to the middle game.
+const double move_time_weights[MAX_VALUE] = {
+    0.5, 1.0, 1.5, 2.0, 2.0, 2.0, 2.0, 2.0, 1.5, 1.5, 1.0, 0.5, 0.25, 0.25, 0.25};
+
+// Fraction of the game time that is kept in reserve, to absorb overhead that
+// is not measured during the search.
+const double game_time_reserve = 0.1;
+
+// Calculates the time to spend on the next move, given the game time budget and
+// the time used so far. The search normally stops deepening when the next
+// iteration is not expected to finish within *target_nanos, and is aborted
+// after *cap_nanos.
+void PlanMoveTime(const State &state, int64_t *target_nanos, int64_t *cap_nanos) {
+  const int64_t budget_nanos = static_cast<int64_t>(game_time*(1 - game_time_reserve)*NANOS_PER_SECOND);
+  const int64_t remaining_nanos = std::max<int64_t>(budget_nanos - GetGameTimeUsedNanos(), 0);
+  const int move = state.moves_played/2;
+  double total_weight = 0;
+  for (int i = move; i < MAX_VALUE; ++i) total_weight += move_time_weights[i];
+  *target_nanos = static_cast<int64_t>(remaining_nanos*move_time_weights[move]/total_weight);
+  *cap_nanos = std::min(3*(*target_nanos), remaining_nanos/2);
+  *cap_nanos = std::max(*cap_nanos, *target_nanos);
+  // Always allow a minimal search, even if the budget has been exhausted.
+  *target_nanos = std::max<int64_t>(*target_nanos, 1000000);
+  *cap_nanos = std::max<int64_t>(*cap_nanos, 1000000);
+}
+
+// Returns whether the search should be aborted. Reading the clock is relatively
+// expensive, so each thread only checks the deadline once every 1024 nodes.
+inline bool IsStopped(SearchContext &ctx) {
+  if (ctx.stop && ctx.stop->load(std::memory_order_relaxed)) return true;
+  const int64_t deadline_nanos = search_deadline_nanos.load(std::memory_order_relaxed);
+  if (deadline_nanos != 0) {
+    const int64_t nodes = ctx.nodes.load(std::memory_order_relaxed);
+    if (nodes >= ctx.next_deadline_check) {
+      ctx.next_deadline_check = nodes + 1024;
+      if (GetBudgetTimeNanos() >= deadline_nanos) deadline_passed = true;
+    }
+  }
+  return deadline_passed.load(std::memory_order_relaxed);
+}
+
+// Returns whether sp is equal to or a descendant of ancestor.
+bool IsDescendant(const SplitPoint *sp, const SplitPoint *ancestor) {
+  for (; sp; sp = sp->parent) {
+    if (sp == ancestor) return true;
+  }
+  return false;
+}
+
+// Search of a single child of a split point.
+struct Task {
+  SplitPoint *split_point;
+  Move move;
+};
+
+// Pool of threads for the YBWC search. Every thread (including the main
+// thread, with index 0) has a deque of tasks. A thread that splits a node pushes
+// the siblings onto the bottom of its own deque, and pops them from there in
+// order. Idle threads steal tasks from the top of other threads' deques, which
+// holds the least promising moves of the shallowest split points.
+class YbwcPool {
+public:
+  // Creates a pool with num_threads - 1 worker threads. The calling thread
+  // joins the pool with index 0, using main_ctx as its search context.
+  YbwcPool(int num_threads, SearchContext *main_ctx) : workers(num_threads) {
+    for (int i = 0; i < num_threads; ++i) {
+      workers[i].reset(new Worker);
+      workers[i]->ctx = i == 0 ? main_ctx : &workers[i]->own_ctx;
+      workers[i]->ctx->pool = this;
+      workers[i]->ctx->pool_index = i;
+    }
+    for (int i = 1; i < num_threads; ++i) {
+      threads.emplace_back(&YbwcPool::WorkerLoop, this, i);
+    }
+  }
+
+  ~YbwcPool() {
+    {
+      std::lock_guard<std::mutex> lock(idle_mutex);
+      stop = true;
+    }
+    work_available.notify_all();
+    for (std::thread &thread : threads) thread.join();
+    workers[0]->ctx->pool = nullptr;
+  }
+
+  // Returns the search context of the given thread. The counters of worker
+  // threads may only be accessed while no search is in progress.
+  SearchContext &Context(int index) { return *workers[index]->ctx; }
+
+  int Size() const { return workers.size(); }
+
+  void Push(int index, const Task &task) {
+    Worker &worker = *workers[index];
+    {
+      std::lock_guard<std::mutex> lock(worker.mutex);
+      worker.tasks.push_back(task);
+    }
+    {
+      std::lock_guard<std::mutex> lock(idle_mutex);
+      ++tasks_pushed;
+    }
+    work_available.notify_one();
+  }
+
+  // Pops the task at the bottom of the given thread's deque, if it belongs to
+  // the given split point.
+  bool PopBottom(int index, const SplitPoint *sp, Task *task) {
+    Worker &worker = *workers[index];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (worker.tasks.empty() || worker.tasks.back().split_point != sp) return false;
+    *task = worker.tasks.back();
+    worker.tasks.pop_back();
+    return true;
+  }
+
+  // Steals a task from the top of another thread's deque. If ancestor is not
+  // null, only tasks of (descendants of) that split point are taken, so that a
+  // thread waiting for its own split point doesn't get stuck in an unrelated
+  // part of the tree.
+  bool Steal(int index, const SplitPoint *ancestor, Task *task) {
+    const int size = workers.size();
+    for (int i = 1; i < size; ++i) {
+      Worker &worker = *workers[(index + i) % size];
+      std::lock_guard<std::mutex> lock(worker.mutex);
+      if (worker.tasks.empty()) continue;
+      if (ancestor && !IsDescendant(worker.tasks.front().split_point, ancestor)) continue;
+      *task = worker.tasks.front();
+      worker.tasks.pop_front();
+      return true;
+    }
+    return false;
+  }
+
+  void Execute(SearchContext &ctx, const Task &task);
+
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+    SearchContext *ctx;
+    SearchContext own_ctx;
+  };
+
+  // Runs stolen tasks until the pool is destroyed. A worker that finds nothing
+  // to steal sleeps until a task is pushed, instead of spinning (which would
+  // count against the move budget with --cpu_time).
+  void WorkerLoop(int index) {
+    SearchContext &ctx = Context(index);
+    Task task;
+    for (;;) {
+      uint64_t seen;
+      {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        if (stop) return;
+        seen = tasks_pushed;
+      }
+      if (Steal(index, nullptr, &task)) {
+        Execute(ctx, task);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(idle_mutex);
+      work_available.wait(lock, [&]{ return stop || tasks_pushed != seen; });
+    }
+  }
+
+  vector<std::unique_ptr<Worker>> workers;
+  vector<std::thread> threads;
+
+  // Protects stop and tasks_pushed, which idle workers wait on.
+  std::mutex idle_mutex;
+  std::condition_variable work_available;
+  uint64_t tasks_pushed = 0;
+  bool stop = false;
+};
+
+// Whether the values of root moves are logged during the search.
+bool log_root_moves = true;
+
+// Updates the search results of a node with the value of one of its children.
+// Returns true if this caused a beta cutoff.
+inline bool UpdateBest(const Move &move, int value, int hi, int &lo,
+    int &best_value, Move &best_move, MoveList *best_moves) {
+  if (best_moves && log_root_moves) fprintf(stderr, " %s:%d", FormatMove(move), value);
+  if (best_moves && value >= best_value) {
+    if (value > best_value) best_moves->clear();
+    best_moves->push_back(move);
+  }
+  if (value > best_value) {
+    best_value = value;
+    best_move = move;
+    if (best_value > lo) {
+      if (best_value >= hi) return true;
+      lo = best_value;
+      // This is necessary to get all best moves. Otherwise, future values
+      // equal to best_value are only upper bounds, and only the first
+      // element of best_moves is guaranteed to be a "best" move.
+      if (best_moves) --lo;
+    }
+  }
+  return false;
+}
+
+template<bool ROOT>
+int SearchNode(SearchContext &ctx, State &state, int depth, int lo, int hi,
+    MoveList *best_moves, const FieldList &fields_to_search);
+
+int SearchLeaf(SearchContext &ctx, const State &state, int hi,
+    const FieldList &fields_to_search);
+
+// Executes the given move, searches the resulting state with the window
+// [lo,hi] from the perspective of the player who made the move, and undoes the
+// move again.
+//
+// If scout is true (for moves other than the first), the child is first
+// searched with a null window just above lo, which is cheap and suffices to
+// prove that the move is not better than the best move found so far. Only if
+// it fails high is the child searched again with the full window. Children at
+// depth 1 are evaluated by SearchLeaf(), whose cost and result only depend on
+// the upper bound of the window, so they are never searched twice.
+int SearchChild(SearchContext &ctx, State &state, const Move &move, int depth,
+    int lo, int hi, bool scout, const FieldList &fields_to_search) {
+  DoMove(state, move);
+  int value;
+  if (scout && hi - lo > 1 && depth > 2) {
+    value = -SearchNode<false>(ctx, state, depth - 1, -lo - 1, -lo, nullptr, fields_to_search);
+    if (!ctx.aborted && value > lo && value < hi) {
+      value = -SearchNode<false>(ctx, state, depth - 1, -hi, -lo, nullptr, fields_to_search);
+    }
+  } else {
+    value = -SearchNode<false>(ctx, state, depth - 1, -hi, -lo, nullptr, fields_to_search);
+  }
+  UndoMove(state, move);
+  return value;
+}
+
+// Reorders moves so that the killer moves of the current ply come first,
+// followed by the remaining moves in order of decreasing history score. Moves
+// with equal scores keep their relative order, so the static field order of
+// CalculateFieldsToSearch() breaks ties.
+void OrderMoves(const SearchContext &ctx, const State &state, Move *moves, int num_moves) {
+  int first = 0;
+  for (const Move &killer : ctx.killers[state.moves_played]) {
+    for (int i = first; i < num_moves; ++i) {
+      if (moves[i].field == killer.field && moves[i].value == killer.value) {
+        std::rotate(moves + first, moves + i, moves + i + 1);
+        ++first;
+        break;
+      }
+    }
+  }
+  // Insertion sort, since it is stable and doesn't allocate memory.
+  for (int i = first + 1; i < num_moves; ++i) {
+    const Move move = moves[i];
+    const int score = ctx.history[move.field][move.value];
+    int j = i;
+    while (j > first && ctx.history[moves[j - 1].field][moves[j - 1].value] < score) {
+      moves[j] = moves[j - 1];
+      --j;
+    }
+    moves[j] = move;
+  }
+}
+
+// Returns a hash of the part of the state that determines the outcome of the
+// rest of the game: the set of empty fields, their scores, and the values left
+// to each player. The values of occupied fields are irrelevant, since they
+// only affect the outcome through the scores of their neighbours.
+uint64_t EndgameKey(const State &state) {
+  const uint64_t empty = EmptyFields(state);
+  uint64_t h = empty ^ uint64_t{state.used[0]} << 36 ^ uint64_t{state.used[1]} << 48;
+  for (uint64_t m = empty; m; ) {
+    h = (h ^ static_cast<uint8_t>(state.score[PopLowestBit(m)])) * 0x100000001b3ULL;
+  }
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+// Calculates bounds on the final value of the game, from the perspective of the
+// next player. At the end of the game a single field remains empty, and the
+// game's value is the FieldValue() of its score. Each remaining move by a
+// player can change the score of a field by at most its highest unused value,
+// and only as many moves as the field has empty neighbours affect it.
+void EndgameBounds(const State &state, int *min_value, int *max_value) {
+  const int moves_left = MAX_MOVES - state.moves_played;
+  const int player = GetNextPlayer(state);
+  int moves[2];
+  moves[player] = (moves_left + 1)/2;
+  moves[1 - player] = moves_left/2;
+  // top[p][k] is the sum of the k highest values left to player p.
+  int top[2][7] = {};
+  for (int p = 0; p < 2; ++p) {
+    unsigned values = UnusedValues(state, p);
+    for (int k = 1; k < 7; ++k) {
+      top[p][k] = top[p][k - 1];
+      if (k <= moves[p] && values) {
+        const int value = HighestBit(values);
+        values &= ~(1u << value);
+        top[p][k] += value;
+      }
+    }
+  }
+  int lo = INT_MAX, hi = INT_MIN;
+  const uint64_t empty = EmptyFields(state);
+  for (uint64_t m = empty; m; ) {
+    const int field = PopLowestBit(m);
+    const int n = PopCount(neighbour_mask[field] & empty);
+    lo = std::min(lo, FieldValue(state.score[field] - top[1][n]));
+    hi = std::max(hi, FieldValue(state.score[field] + top[0][n]));
+  }
+  if (player == 0) {
+    *min_value = lo;
+    *max_value = hi;
+  } else {
+    *min_value = -hi;
+    *max_value = -lo;
+  }
+}
+
+// Sets field_values[field] to the values to search on each empty field among
+// fields_to_search, and returns their union.
+//
+// An empty field without empty neighbours is settled: a stone there changes
+// the score of no empty field, and its own score can no longer change. Moves
+// onto settled fields with the same score therefore lead to equivalent states,
+// so if collapse_settled is set, only the first of them is searched.
+unsigned GenerateFieldValues(const State &state, int player, const FieldList &fields_to_search,
+    bool collapse_settled, unsigned *field_values) {
+  const uint64_t empty = EmptyFields(state);
+  uint64_t settled_scores[4] = {};  // bitset indexed by score (as uint8_t)
+  unsigned all_values = 0;
+  for (int field : fields_to_search) {
+    if (!((empty >> field) & 1)) continue;
+    if (collapse_settled && (neighbour_mask[field] & empty) == 0) {
+      const uint8_t score = state.score[field];
+      if ((settled_scores[score >> 6] >> (score & 63)) & 1) {
+        field_values[field] = 0;
+        continue;
+      }
+      settled_scores[score >> 6] |= uint64_t{1} << (score & 63);
+    }
+    all_values |= field_values[field] = ValuesToSearch(state, player, empty, field);
+  }
+  return all_values;
+}
+
+// Searches a state at depth 1 below the root, with the same result conventions
+// as Search() for a window with upper bound hi (the lower bound doesn't
+// matter). No moves are executed: since FieldValue() is increasing, the best
+// value to place on a field is the highest one searched there, and its value
+// is computed from the gain it causes on each empty field, which is shared by
+// all fields that the value is placed on.
+int SearchLeaf(SearchContext &ctx, const State &state, int hi,
+    const FieldList &fields_to_search) {
+  ctx.CountNode(1);
+  const int player = GetNextPlayer(state);
+  const int sign = player == 0 ? 1 : -1;
+  const uint64_t empty = EmptyFields(state);
+  unsigned field_values[NUM_FIELDS];
+  GenerateFieldValues(state, player, fields_to_search, true, field_values);
+  const int eval = sign*state.eval;
+  int gain[NUM_FIELDS];  // gain[field] if gain_value is placed next to it
+  int gain_value = 0;
+  int best_value = INT_MIN;
+  int leaves = 0;
+  for (int field : fields_to_search) {
+    if (!((empty >> field) & 1) || !field_values[field]) continue;
+    const int value = HighestBit(field_values[field]);
+    const uint64_t neighbours = neighbour_mask[field] & empty;
+    if (value != gain_value && neighbours) {
+      gain_value = value;
+      for (uint64_t m = empty; m; ) {
+        const int f = PopLowestBit(m);
+        gain[f] = sign*(FieldValue(state.score[f] + sign*value) - FieldValue(state.score[f]));
+      }
+    }
+    int result = eval - sign*FieldValue(state.score[field]);
+    for (uint64_t m = neighbours; m; ) result += gain[PopLowestBit(m)];
+    ++leaves;
+    if (result > best_value) {
+      best_value = result;
+      if (best_value >= hi) break;
+    }
+  }
+  ctx.CountNodes(0, leaves);
+  return best_value;
+}
+
+// Exact endgame solver: negamax search with alpha-beta pruning to the end of
+// the game, using the same conventions as Search(). Results are memoized in
+// endgame_table, and subtrees are cut off when EndgameBounds() shows that their
+// value lies outside the search window.
+int Solve(SearchContext &ctx, State &state, int lo, int hi,
+    const FieldList &fields_to_search) {
+  assert(lo < hi);
+
+  if (IsStopped(ctx) || (ctx.split_point && IsCancelled(ctx.split_point))) {
+    ctx.aborted = true;
+    return 0;
+  }
+
+  const int depth = MAX_MOVES - state.moves_played;
+  ctx.CountNode(depth);
+
+  if (depth == 0) return Evaluate(state);
+
+  int min_value, max_value;
+  EndgameBounds(state, &min_value, &max_value);
+  if (max_value <= lo) return max_value;
+  if (min_value >= hi) return min_value;
+
+  const int original_lo = lo;
+  const uint64_t key = EndgameKey(state);
+  Move table_move = {-1, 0};
+  TTEntry entry;
+  const bool hit = ctx.endgame->Enabled() && ctx.endgame->Probe(key, &entry);
+  if (ctx.endgame->Enabled()) ctx.counters.CountProbe(hit);
+  if (hit) {
+    if (entry.bound == BOUND_EXACT ||
+        (entry.bound == BOUND_LOWER && entry.value >= hi) ||
+        (entry.bound == BOUND_UPPER && entry.value <= lo)) {
+      ctx.counters.CountProbeCutoff();
+      return entry.value;
+    }
+    table_move = entry.move;
+  }
+
+  const int player = GetNextPlayer(state);
+  const uint64_t empty = EmptyFields(state);
+  unsigned field_values[NUM_FIELDS];
+  const unsigned all_values = GenerateFieldValues(state, player, fields_to_search, true, field_values);
+  Move moves[NUM_FIELDS*MAX_VALUE];
+  int num_moves = 0;
+  if (table_move.field >= 0 && IsValidMove(state, table_move) &&
+      ((field_values[table_move.field] >> table_move.value) & 1)) {
+    moves[num_moves++] = table_move;
+  } else {
+    table_move.field = -1;
+  }
+  for (unsigned values = all_values; values; ) {
+    const int value = HighestBit(values);
+    values &= ~(1u << value);
+    for (int field : fields_to_search) {
+      if (!((empty >> field) & 1) || !((field_values[field] >> value) & 1)) continue;
+      if (field == table_move.field && value == table_move.value) continue;
+      moves[num_moves++] = Move{field, value};
+    }
+  }
+
+  int best_value = INT_MIN;
+  Move best_move = {-1, 0};
+  for (int i = 0; i < num_moves; ++i) {
+    const Move &move = moves[i];
+    int value;
+    if (depth == 1) {
+      ctx.CountNode(0);
+      value = EvaluateMove(state, move);
+    } else {
+      DoMove(state, move);
+      value = -Solve(ctx, state, -hi, -lo, fields_to_search);
+      UndoMove(state, move);
+      if (ctx.aborted) return 0;
+    }
+    if (value > best_value) {
+      best_value = value;
+      best_move = move;
+      if (best_value > lo) {
+        if (best_value >= hi) {
+          ctx.counters.CountCutoff(i);
+          break;
+        }
+        lo = best_value;
+      }
+    }
+  }
+  if (ctx.endgame->Enabled()) {
+    Bound bound =
+        best_value <= original_lo ? BOUND_UPPER :
+        best_value >= hi ? BOUND_LOWER : BOUND_EXACT;
+    ctx.endgame->Store(key, depth, best_value, bound, best_move);
+  }
+  return best_value;
+}
+
+// Negamax depth-first search with alpha-beta pruning, using principal variation
+// search (see SearchChild()) for all moves but the first.
+//
+// If the result is in [lo,hi] (excluding the boundaries), the value is exact.
+// If the result is less than or equal to lo, or greater than or equal to hi,
+// then it is an upper or lower bound on the true value, respectively.
+//
+// Results are stored in the transposition table, which is used to cut off
+// searches of transposed states, and to search the best move found previously
+// first. At the root (when best_moves is given) no cutoffs are taken, since
+// all best moves must be found.
+//
+// SearchNode() is instantiated separately for the root and for the nodes below
+// it, so that the checks for the root compile away in the latter, where almost
+// all nodes are searched. Below the root, nodes at depth 1 are handled by
+// SearchLeaf().
+template<bool ROOT>
+int SearchNode(SearchContext &ctx, State &state, int depth, int lo, int hi,
+    MoveList *best_moves, const FieldList &fields_to_search) {
+  assert(lo < hi);  // invariant maintained throughout this function
+  assert(ROOT == (best_moves != nullptr));
+
+  if (IsStopped(ctx) || (ctx.split_point && IsCancelled(ctx.split_point))) {
+    ctx.aborted = true;
+    return 0;
+  }
+
+  if (!ROOT && depth == 1) return SearchLeaf(ctx, state, hi, fields_to_search);
+
+  // Below the root, positions that are searched to the end of the game and have
+  // few enough empty fields are handed off to the endgame solver.
+  if (!ROOT && depth == MAX_MOVES - state.moves_played &&
+      PopCount(EmptyFields(state)) <= endgame_empty_fields) {
+    return Solve(ctx, state, lo, hi, fields_to_search);
+  }
+
+  ctx.CountNode(depth);
+
+  if (depth == 0) {
+    assert(!ROOT);
+    return Evaluate(state);
+  }
+
+  assert(!IsGameOver(state));  // caller should make sure depth is limited
+
+  const int original_lo = lo;
+  Move tt_move = {-1, 0};
+  TTEntry entry;
+  bool hit = ctx.table->Enabled() && ctx.table->Probe(state.hash, &entry);
+  if (ctx.table->Enabled()) ctx.counters.CountProbe(hit);
+  if (cache.Enabled() && depth >= min_cache_depth && !(hit && entry.depth >= depth)) {
+    // The transposition table has no result that is deep enough; maybe another
+    // search found one before.
+    TTEntry cache_entry;
+    const bool cache_hit = cache.Probe(state, &cache_entry);
+    ctx.counters.CountProbe(cache_hit);
+    if (cache_hit && (!hit || cache_entry.depth > entry.depth)) {
+      entry = cache_entry;
+      hit = true;
+    }
+  }
+  if (hit) {
+    if (!ROOT && entry.depth >= depth) {
+      if (entry.bound == BOUND_EXACT ||
+          (entry.bound == BOUND_LOWER && entry.value >= hi) ||
+          (entry.bound == BOUND_UPPER && entry.value <= lo)) {
+        ctx.counters.CountProbeCutoff();
+        return entry.value;
+      }
+    }
+    tt_move = entry.move;
+  }
+
+  const int player = GetNextPlayer(state);
+
+  // Generate moves. The move from the transposition table is searched first. It
+  // may be invalid in case of a hash collision, or if its value is not searched
+  // in the current value_mode, so it is verified before use.
+  const uint64_t empty = EmptyFields(state);
+  // At the root, all moves are searched, so that best_moves is complete.
+  unsigned field_values[NUM_FIELDS];
+  const unsigned all_values = GenerateFieldValues(state, player, fields_to_search, !ROOT, field_values);
+  Move moves[NUM_FIELDS*MAX_VALUE];
+  int num_moves = 0;
+  if (tt_move.field >= 0 && IsValidMove(state, tt_move) &&
+      ((field_values[tt_move.field] >> tt_move.value) & 1)) {
+    moves[num_moves++] = tt_move;
+  } else {
+    tt_move.field = -1;
+  }
+  // At the root, moves that are mapped onto each other by a symmetry of the
+  // state have the same value, so only the move on the lowest field of each
+  // class is searched. The others are added to best_moves afterwards.
+  const unsigned state_symmetries = ROOT ? StateSymmetries(state) : 1;
+  Move symmetric_moves[NUM_FIELDS*MAX_VALUE];
+  int num_symmetric_moves = 0;
+  for (unsigned values = all_values; values; ) {
+    const int value = HighestBit(values);
+    values &= ~(1u << value);
+    for (int field : fields_to_search) {
+      if (!((empty >> field) & 1) || !((field_values[field] >> value) & 1)) continue;
+      if (field == tt_move.field && value == tt_move.value) continue;
+      if (state_symmetries != 1 && symmetries.Representative(state_symmetries, field) != field) {
+        symmetric_moves[num_symmetric_moves++] = Move{field, value};
+        continue;
+      }
+      moves[num_moves++] = Move{field, value};
+    }
+  }
+  if (enable_killer_history) {
+    const int first = tt_move.field >= 0;
+    OrderMoves(ctx, state, moves + first, num_moves - first);
+  }
+
+  int best_value = INT_MIN;
+  Move best_move = {-1, 0};
+  for (int i = 0; i < num_moves; ++i) {
+    const Move &move = moves[i];
+    if (i == 1 && ctx.pool && depth >= min_split_depth && num_moves > 2) {
+      // Young brothers wait: the first move has been searched, so search the
+      // remaining moves in parallel.
+      SplitPoint sp;
+      sp.parent = ctx.split_point;
+      sp.state = &state;
+      sp.fields_to_search = &fields_to_search;
+      sp.depth = depth;
+      sp.hi = hi;
+      sp.lo = lo;
+      sp.best_value = best_value;
+      sp.best_move = best_move;
+      sp.best_moves = best_moves;
+      sp.pending = num_moves - i;
+      YbwcPool &pool = *ctx.pool;
+      for (int j = num_moves - 1; j >= i; --j) pool.Push(ctx.pool_index, Task{&sp, moves[j]});
+      // Help with the split point's tasks while there are any left to take,
+      // then sleep until the other threads have finished theirs.
+      Task task;
+      while (pool.PopBottom(ctx.pool_index, &sp, &task) ||
+          pool.Steal(ctx.pool_index, &sp, &task)) {
+        pool.Execute(ctx, task);
+      }
+      {
+        std::unique_lock<std::mutex> lock(sp.mutex);
+        sp.finished.wait(lock, [&]{ return sp.pending == 0; });
+      }
+      if (IsCancelled(sp.parent) || IsStopped(ctx)) {
+        ctx.aborted = true;
+      }
+      best_value = sp.best_value;
+      best_move = sp.best_move;
+      break;
+    }
+    int value;
+    if (ROOT && depth == 1) {
+      // Evaluate leaf nodes without executing the move.
+      ctx.CountNode(0);
+      value = EvaluateMove(state, move);
+    } else {
+      value = SearchChild(ctx, state, move, depth, lo, hi, i > 0, fields_to_search);
+      if (ctx.aborted) break;
+    }
+    if (UpdateBest(move, value, hi, lo, best_value, best_move, ROOT ? best_moves : nullptr)) {
+      ctx.RecordCutoff(state, move, depth);
+      ctx.counters.CountCutoff(i);
+      break;
+    }
+  }
+  if (ctx.aborted) {
+    // At the root, the moves found so far are kept if they are at least as
+    // good as the first move searched, which is the best move of the previous
+    // iteration (taken from the transposition table).
+    if (ROOT && best_value <= original_lo) best_moves->clear();
+    return 0;
+  }
+  if (ROOT && log_root_moves) fputc('\n', stderr);
+  for (int i = 0; i < num_symmetric_moves; ++i) {
+    const Move &move = symmetric_moves[i];
+    const int field = symmetries.Representative(state_symmetries, move.field);
+    for (int j = 0, n = best_moves->size(); j < n; ++j) {
+      if ((*best_moves)[j].field == field && (*best_moves)[j].value == move.value) {
+        best_moves->push_back(move);
+        break;
+      }
+    }
+  }
+  const Bound bound =
+      best_value <= original_lo ? BOUND_UPPER :
+      best_value >= hi ? BOUND_LOWER : BOUND_EXACT;
+  if (ctx.table->Enabled()) {
+    ctx.table->Store(state.hash, depth, best_value, bound, best_move);
+  }
+  if (cache.Enabled() && depth >= min_cache_depth) {
+    cache.Store(state, depth, best_value, bound, best_move);
+  }
+  return best_value;
+}
+
+int Search(SearchContext &ctx, State &state, int depth, int lo, int hi,
+    MoveList *best_moves, const FieldList &fields_to_search) {
+  return best_moves
+      ? SearchNode<true>(ctx, state, depth, lo, hi, best_moves, fields_to_search)
+      : SearchNode<false>(ctx, state, depth, lo, hi, nullptr, fields_to_search);
+}
+
+// Searches the child of a split point given by a task, and updates the split
+// point's results.
+void YbwcPool::Execute(SearchContext &ctx, const Task &task) {
+  SplitPoint &sp = *task.split_point;
+  if (!IsCancelled(&sp)) {
+    int lo;
+    {
+      std::lock_guard<std::mutex> lock(sp.mutex);
+      lo = sp.lo;
+    }
+    State state = *sp.state;
+    SplitPoint *saved_split_point = ctx.split_point;
+    ctx.split_point = &sp;
+    int value = SearchChild(ctx, state, task.move, sp.depth, lo, sp.hi, true, *sp.fields_to_search);
+    ctx.split_point = saved_split_point;
+    if (ctx.aborted) {
+      ctx.aborted = false;
+    } else {
+      std::lock_guard<std::mutex> lock(sp.mutex);
+      if (UpdateBest(task.move, value, sp.hi, sp.lo, sp.best_value, sp.best_move, sp.best_moves)) {
+        sp.cancelled = true;
+        ctx.RecordCutoff(state, task.move, sp.depth);
+        // The index of the move is not known here, but it is never the first.
+        ctx.counters.CountCutoff(1);
+      }
+    }
+  }
+  // Notify while holding the lock: once the owner sees pending == 0, it
+  // returns and sp goes out of scope.
+  std::lock_guard<std::mutex> lock(sp.mutex);
+  if (--sp.pending == 0) sp.finished.notify_one();
+}
+
+// Only search fields that are unoccupied, and order them by decreasing number
+// of liberties (i.e. number of unoccupied neighbouring fields). This means the
+// best fields appear first, which improves the beta-cutoff rate.
+//
+// Fields with equal liberties are shuffled using rng if given, or rand()
+// otherwise.
+FieldList CalculateFieldsToSearch(const State &state, std::minstd_rand *rng = nullptr) {
+  FieldList fields;
+  int liberties[NUM_FIELDS] = {};
+  const uint64_t empty = EmptyFields(state);
+  for (uint64_t m = empty; m; ) {
+    int field = PopLowestBit(m);
+    fields.push_back(field);
+    liberties[field] = PopCount(neighbour_mask[field] & empty);
+  }
+  if (enable_move_ordering) {
+    if (rng) {
+      std::shuffle(fields.begin(), fields.end(), *rng);
+    } else {
+      std::random_shuffle(fields.begin(), fields.end());
+    }
+    // Insertion sort, since it is stable and (unlike std::stable_sort) doesn't
+    // allocate memory.
+    for (int i = 1; i < fields.size(); ++i) {
+      const int field = fields[i];
+      int j = i;
+      while (j > 0 && liberties[fields[j - 1]] < liberties[field]) {
+        fields[j] = fields[j - 1];
+        --j;
+      }
+      fields[j] = field;
+    }
+  }
+  return fields;
+}
+
+SearchContext main_context;
+
+// Lazy SMP helper thread: runs iterative deepening searches from the root
+// state until stopped, to fill the shared transposition table for the main
+// thread. Helpers use different move orders and depths, so that they tend to
+// search different parts of the tree. Depths stay even like the main search's:
+// values of odd depths are biased towards the side to move, and would replace
+// the main thread's results through the transposition table.
+void HelperSearch(const State *root, int index, SearchContext *ctx) {
+  State state = *root;
+  std::minstd_rand rng(index);
+  const FieldList fields = CalculateFieldsToSearch(state, &rng);
+  const int moves_left = MAX_MOVES - state.moves_played;
+  for (int search_depth = min_search_depth + 2*(index%2); !ctx->aborted; search_depth += 2) {
+    int d = std::min(search_depth, moves_left);
+    ctx->counters.Clear();
+    Search(*ctx, state, d, -1000, +1000, nullptr, fields);
+    if (d == moves_left) break;
+  }
+}
+
+// Searches the current state while the opponent is thinking, to fill the
+// transposition table, so that the search of our next move starts warm. The
+// threads run the same iterative deepening as Lazy SMP helpers, and are
+// stopped as soon as the opponent's move has been read.
+class Ponderer {
+public:
+  ~Ponderer() { Stop(); }
+
+  void Start(const State &state) {
+    Stop();
+    root = state;
+    stop = false;
+    for (int i = 0; i < num_threads; ++i) {
+      contexts.emplace_back(new SearchContext);
+      contexts.back()->stop = &stop;
+      threads.emplace_back(HelperSearch, &root, i, contexts.back().get());
+    }
+  }
+
+  void Stop() {
+    if (threads.empty()) return;
+    stop = true;
+    for (std::thread &thread : threads) thread.join();
+    int64_t nodes = 0;
+    for (auto &ctx : contexts) nodes += ctx->nodes.load(std::memory_order_relaxed);
+    fprintf(stderr, "Pondered %lld nodes\n", (long long)nodes);
+    threads.clear();
+    contexts.clear();
+  }
+
+private:
+  State root;
+  std::atomic<bool> stop{false};
+  vector<std::unique_ptr<SearchContext>> contexts;
+  vector<std::thread> threads;
+};
+
+// Statistics of the last call to SelectMove(), for benchmarking.
+struct SearchStats {
+  int depth = 0;  // depth of the deepest completed iteration (MCTS: of the tree)
+  int value = 0;  // value found by that iteration (MCTS: reward scaled to +/-100)
+  int64_t nodes = 0;  // nodes searched by all threads (MCTS: moves simulated)
+  double wall_time_secs = 0;
+};
+
+// Monte-Carlo tree search. Each iteration descends the tree from the root by
+// UCT, expands the leaf it reaches, plays the rest of the game out with cheap
+// moves, and adds the result to the nodes on the path.
+//
+// All threads share the tree (tree parallelism). A node's visit count is
+// incremented when a thread descends through it, but its reward only when the
+// playout has finished, so that a path that is in progress counts as a loss
+// (virtual loss), which steers the other threads elsewhere. Nodes are
+// allocated from a fixed arena, and the tree stops growing when it is full.
+struct MctsNode {
+  Move move;  // move that leads to this node
+  int num_children;
+  int64_t first_child;  // index in the arena
+
+  // 0: leaf, 1: being expanded by some thread, 2: children are valid.
+  std::atomic<int> expansion{0};
+
+  std::atomic<int> visits{0};
+
+  // Sum of the rewards of the playouts through this node, for the player that
+  // played move, in units of 1/MCTS_REWARD_SCALE.
+  std::atomic<int64_t> reward{0};
+
+  void Init(const Move &m) {
+    move = m;
+    num_children = 0;
+    first_child = 0;
+    expansion.store(0, std::memory_order_relaxed);
+    visits.store(0, std::memory_order_relaxed);
+    reward.store(0, std::memory_order_relaxed);
+  }
+};
+
+const int64_t MCTS_REWARD_SCALE = 1 << 16;
+
+// Weight of the final margin in the reward of a playout; the rest depends only
+// on whether the game was won, drawn or lost.
+const double mcts_margin_weight = 0.1;
+
+class MctsArena {
+public:
+  // Allocates the nodes for the size given by mcts_tree_size_mb, unless this
+  // was done already. Called at startup, so that selecting a move doesn't
+  // allocate memory.
+  void Reserve() {
+    const size_t size = std::max<size_t>((mcts_tree_size_mb << 20)/sizeof(MctsNode), 1);
+    if (size != capacity) {
+      nodes.reset(new MctsNode[size]);
+      capacity = size;
+    }
+  }
+
+  // Prepares the arena for a new tree, of which the root is node 0.
+  void Reset(const State &root_state) {
+    Reserve();
+    next = 1;
+    nodes[0].Init(Move{-1, 0});
+    root = root_state;
+  }
+
+  MctsNode &operator[](int64_t index) { return nodes[index]; }
+
+  // Returns the index of n consecutive new nodes, or -1 if the arena is full.
+  int64_t Allocate(int n) {
+    const int64_t index = next.fetch_add(n, std::memory_order_relaxed);
+    return index + n <= (int64_t)capacity ? index : -1;
+  }
+
+  int64_t Size() const { return std::min<int64_t>(next.load(std::memory_order_relaxed), capacity); }
+
+  State root;
+
+private:
+  std::unique_ptr<MctsNode[]> nodes;
+  size_t capacity = 0;
+  std::atomic<int64_t> next{0};
+};
+
+MctsArena mcts_arena;
+
+// Returns the reward of a finished game for the given player.
+double MctsReward(const State &state, int player) {
+  const int hole = CountTrailingZeros(EmptyFields(state));
+  const int score = player == 0 ? state.score[hole] : -state.score[hole];
+  const double outcome = score > 0 ? 1 : score < 0 ? 0 : 0.5;
+  const double margin = 0.5 + std::max(-20, std::min(20, score))/40.0;
+  return (1 - mcts_margin_weight)*outcome + mcts_margin_weight*margin;
+}
+
+// Returns a random value among the values to search for the given field.
+int RandomValue(const State &state, int player, uint64_t empty, int field, std::minstd_rand &rng) {
+  unsigned values = ValuesToSearch(state, player, empty, field);
+  for (int k = rng() % PopCount(values); k > 0; --k) values &= values - 1;
+  return CountTrailingZeros(values);
+}
+
+// Plays random moves until the end of the game. With guided playouts, each
+// move is the better of two random moves, according to EvaluateMove().
+void MctsPlayout(State &state, std::minstd_rand &rng) {
+  int fields[NUM_FIELDS];
+  int n = 0;
+  for (uint64_t m = EmptyFields(state); m; ) fields[n++] = PopLowestBit(m);
+  while (!IsGameOver(state)) {
+    const int player = GetNextPlayer(state);
+    const uint64_t empty = EmptyFields(state);
+    int i = rng() % n;
+    Move move = {fields[i], RandomValue(state, player, empty, fields[i], rng)};
+    if (mcts_guided_playouts && n > 2) {
+      int j = rng() % (n - 1);
+      if (j >= i) ++j;
+      const Move other = {fields[j], RandomValue(state, player, empty, fields[j], rng)};
+      if (EvaluateMove(state, other) > EvaluateMove(state, move)) {
+        move = other;
+        i = j;
+      }
+    }
+    fields[i] = fields[--n];
+    DoMove(state, move);
+  }
+}
+
+// Returns the child of an expanded node with the highest UCT score. Unvisited
+// children come first.
+MctsNode &MctsSelectChild(const MctsNode &node) {
+  const double log_visits = log(std::max(node.visits.load(std::memory_order_relaxed), 1));
+  MctsNode *best = nullptr;
+  double best_score = -1;
+  for (int i = 0; i < node.num_children; ++i) {
+    MctsNode &child = mcts_arena[node.first_child + i];
+    const int visits = child.visits.load(std::memory_order_relaxed);
+    if (visits == 0) return child;
+    const double mean = child.reward.load(std::memory_order_relaxed)/double(MCTS_REWARD_SCALE*visits);
+    const double score = mean + mcts_exploration*sqrt(log_visits/visits);
+    if (score > best_score) {
+      best = &child;
+      best_score = score;
+    }
+  }
+  return *best;
+}
+
+// Adds children for all moves of the state to the node, unless another thread
+// is already doing so, or the arena is full.
+void MctsExpand(MctsNode &node, const State &state, std::minstd_rand &rng) {
+  int expected = 0;
+  if (!node.expansion.compare_exchange_strong(expected, 1, std::memory_order_acquire)) return;
+  const int player = GetNextPlayer(state);
+  const uint64_t empty = EmptyFields(state);
+  Move moves[NUM_FIELDS*MAX_VALUE];
+  int num_moves = 0;
+  for (uint64_t m = empty; m; ) {
+    const int field = PopLowestBit(m);
+    for (uint64_t values = ValuesToSearch(state, player, empty, field); values; ) {
+      moves[num_moves++] = Move{field, PopLowestBit(values)};
+    }
+  }
+  const int64_t first_child = mcts_arena.Allocate(num_moves);
+  if (first_child < 0) {
+    node.expansion.store(0, std::memory_order_relaxed);
+    return;
+  }
+  // Shuffle, so that unvisited children are tried in random order.
+  std::shuffle(moves, moves + num_moves, rng);
+  for (int i = 0; i < num_moves; ++i) mcts_arena[first_child + i].Init(moves[i]);
+  node.first_child = first_child;
+  node.num_children = num_moves;
+  node.expansion.store(2, std::memory_order_release);
+}
+
+// Runs one MCTS iteration. Returns the depth of the tree path.
+int MctsIterate(std::minstd_rand &rng) {
+  State state = mcts_arena.root;
+  MctsNode *path[MAX_MOVES + 1];
+  int length = 0;
+  MctsNode *node = &mcts_arena[0];
+  node->visits.fetch_add(1, std::memory_order_relaxed);
+  path[length++] = node;
+  for (;;) {
+    if (IsGameOver(state)) break;
+    if (node->expansion.load(std::memory_order_acquire) != 2) {
+      // Leaves are only expanded on their second visit, so that the arena is not
+      // used up by nodes that are visited once.
+      if (node->visits.load(std::memory_order_relaxed) < 2) break;
+      MctsExpand(*node, state, rng);
+      if (node->expansion.load(std::memory_order_acquire) != 2) break;
+    }
+    node = &MctsSelectChild(*node);
+    node->visits.fetch_add(1, std::memory_order_relaxed);
+    DoMove(state, node->move);
+    path[length++] = node;
+  }
+  MctsPlayout(state, rng);
+  // Node i of the path was reached by a move of the player who moves at the
+  // root if i is odd.
+  const int root_player = GetNextPlayer(mcts_arena.root);
+  const int64_t rewards[2] = {
+      static_cast<int64_t>(MctsReward(state, root_player)*MCTS_REWARD_SCALE),
+      static_cast<int64_t>(MctsReward(state, 1 - root_player)*MCTS_REWARD_SCALE)};
+  for (int i = 1; i < length; ++i) {
+    path[i]->reward.fetch_add(rewards[(i - 1) & 1], std::memory_order_relaxed);
+  }
+  return length - 1;
+}
+
+Move SelectMoveMcts(State &state, SearchStats *stats) {
+  const int64_t cpu_time_nanos = GetCpuTimeNanos();
+  const int64_t wall_time_nanos = GetWallTimeNanos();
+
+  // MCTS can stop at any time, so it stops at the target time rather than the
+  // cap. Without a time limit, it simulates about max_nodes moves.
+  int64_t target_nanos = 0, cap_nanos = 0;
+  if (game_time > 0) {
+    PlanMoveTime(state, &target_nanos, &cap_nanos);
+    fprintf(stderr, "Time plan: target %.3fs\n", 1e-9*target_nanos);
+  } else if (move_time > 0) {
+    target_nanos = static_cast<int64_t>(move_time*NANOS_PER_SECOND);
+  }
+  const int64_t deadline_nanos = target_nanos > 0 ? GetBudgetTimeNanos() + target_nanos : 0;
+
+  // MCTS does not collect search counters.
+  main_context.counters.Clear();
+  mcts_arena.Reset(state);
+  // The root is always expanded, so that there is a move to return.
+  std::minstd_rand root_rng(rand());
+  MctsExpand(mcts_arena[0], state, root_rng);
+  CHECK(mcts_arena[0].expansion.load() == 2);
+
+  const int moves_left = MAX_MOVES - state.moves_played;
+  const unsigned seed = rand();
+  std::atomic<int64_t> total_iterations{0};
+  std::atomic<int> max_depth{0};
+  std::atomic<bool> stop{false};
+  auto worker = [&](int index) {
+    std::minstd_rand rng(seed + index);
+    int64_t iterations = 0;
+    int depth = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+      depth = std::max(depth, MctsIterate(rng));
+      if (++iterations % 64 == 0) {
+        const int64_t total = total_iterations.fetch_add(64, std::memory_order_relaxed) + 64;
+        if (deadline_nanos > 0 ? GetBudgetTimeNanos() >= deadline_nanos :
+            total*moves_left >= max_nodes) {
+          stop = true;
+        }
+      }
+    }
+    total_iterations.fetch_add(iterations % 64, std::memory_order_relaxed);
+    for (int d = max_depth.load(); d < depth && !max_depth.compare_exchange_weak(d, depth); ) {}
+  };
+  vector<std::thread> threads;
+  for (int i = 1; i < num_threads; ++i) threads.emplace_back(worker, i);
+  worker(0);
+  for (std::thread &thread : threads) thread.join();
+
+  // Play the most visited move.
+  const MctsNode &root = mcts_arena[0];
+  const MctsNode *best = nullptr;
+  for (int i = 0; i < root.num_children; ++i) {
+    const MctsNode &child = mcts_arena[root.first_child + i];
+    if (log_root_moves) {
+      fprintf(stderr, " %s:%d/%.3f", FormatMove(child.move), child.visits.load(),
+          child.reward.load()/double(MCTS_REWARD_SCALE*std::max(child.visits.load(), 1)));
+    }
+    if (best == nullptr || child.visits.load() > best->visits.load()) best = &child;
+  }
+  if (log_root_moves) fputc('\n', stderr);
+  const double mean = best->reward.load()/double(MCTS_REWARD_SCALE*std::max(best->visits.load(), 1));
+  const int64_t iterations = total_iterations.load();
+  const int64_t simulated_moves = iterations*moves_left;
+  const double wall_time_secs = 1e-9*(GetWallTimeNanos() - wall_time_nanos);
+  fprintf(stderr, "mcts playouts=%lld tree=%lld depth=%d best=%s v=%.3f (%.3fm/s)\n",
+      (long long)iterations, (long long)mcts_arena.Size(), max_depth.load(), FormatMove(best->move),
+      mean, simulated_moves*1e-6/std::max(wall_time_secs, 1e-9));
+  const double cpu_time_secs = 1e-9*(GetCpuTimeNanos() - cpu_time_nanos);
+  if (cpu_time_secs > 0.1) {
+    fprintf(stderr, "%.3lfs cpu %.3lfs wall\n", cpu_time_secs, wall_time_secs);
+  }
+  if (stats) {
+    stats->depth = max_depth;
+    stats->value = static_cast<int>(lround(200*mean - 100));
+    stats->nodes = simulated_moves;
+    stats->wall_time_secs = wall_time_secs;
+  }
+  CHECK(IsValidMove(state, best->move));
+  return best->move;
+}
+
+Move SelectMove(State &state, SearchStats *stats = nullptr) {
+  if (engine == Engine::MCTS) return SelectMoveMcts(state, stats);
+
+  int64_t cpu_time_nanos = GetCpuTimeNanos();
+  int64_t wall_time_nanos = GetWallTimeNanos();
+
+  DebugStateSwapper setter(state);
+
+  SearchContext &ctx = main_context;
+  ctx.nodes = 0;
+  ctx.next_deadline_check = 0;
+  ctx.aborted = false;
+  ctx.AgeMoveOrdering();
+
+  const int64_t budget_start_nanos = GetBudgetTimeNanos();
+  int64_t target_nanos = 0, cap_nanos = 0;
+  if (game_time > 0) {
+    PlanMoveTime(state, &target_nanos, &cap_nanos);
+    fprintf(stderr, "Time plan: target %.3fs cap %.3fs\n", 1e-9*target_nanos, 1e-9*cap_nanos);
+  } else if (move_time > 0) {
+    target_nanos = cap_nanos = static_cast<int64_t>(move_time*NANOS_PER_SECOND);
+  }
+  search_deadline_nanos = cap_nanos > 0 ? budget_start_nanos + cap_nanos : 0;
+  deadline_passed = false;
+
+  // Helpers copy the root state when they start, by which time the main thread
+  // is already making moves on `state`, so they get a copy that stays intact.
+  const State root = state;
+  std::atomic<bool> stop_helpers{false};
+  vector<std::unique_ptr<SearchContext>> helper_contexts;
+  vector<std::thread> helper_threads;
+  std::unique_ptr<YbwcPool> pool;
+  if (num_threads > 1 && parallel_mode == ParallelMode::YBWC) {
+    pool.reset(new YbwcPool(num_threads, &ctx));
+  } else {
+    for (int i = 1; i < num_threads; ++i) {
+      helper_contexts.emplace_back(new SearchContext);
+      helper_contexts.back()->stop = &stop_helpers;
+      helper_threads.emplace_back(HelperSearch, &root, i, helper_contexts.back().get());
+    }
+  }
+
+  // Returns the number of nodes searched by all threads.
+  auto total_nodes = [&]() {
+    int64_t nodes = ctx.nodes.load(std::memory_order_relaxed);
+    for (auto &helper : helper_contexts) nodes += helper->nodes.load(std::memory_order_relaxed);
+    for (int i = 1; pool && i < pool->Size(); ++i) {
+      nodes += pool->Context(i).nodes.load(std::memory_order_relaxed);
+    }
+    return nodes;
+  };
+
+  Move best_move = {-1, 0};
+  const FieldList fields = CalculateFieldsToSearch(state);
+  const int moves_left = MAX_MOVES - state.moves_played;
+  int64_t total_evals = 0;
+  int search_depth = min_search_depth;
+  int previous_value = 0;
+  int64_t previous_iteration_nodes = 0;
+  int stable_iterations = 1;  // number of iterations that kept the best move
+  for (;;) {
+    const int64_t iteration_start_nanos = GetBudgetTimeNanos();
+    const int64_t iteration_start_nodes = total_nodes();
+    const Move previous_best_move = best_move;
+    int d = std::min(search_depth, moves_left);
+    ctx.counters.Clear();
+    for (int i = 1; pool && i < pool->Size(); ++i) {
+      pool->Context(i).counters.Clear();
+    }
+
+    int lo = -1000, hi = +1000;
+    int delta = aspiration_window;
+    if (delta > 0 && search_depth > min_search_depth) {
+      lo = std::max(lo, previous_value - delta);
+      hi = std::min(hi, previous_value + delta);
+    }
+    MoveList best_moves;
+    int value;
+    for (;;) {
+      best_moves.clear();
+      value = Search(ctx, state, d, lo, hi, &best_moves, fields);
+      if (ctx.aborted) break;
+      // The set of best moves is only complete if the value is exact.
+      if (value > lo && value < hi) break;
+      delta *= aspiration_growth;
+      if (value <= lo) {
+        CHECK(lo > -1000);
+        lo = std::max(-1000, value - delta);
+      } else {
+        CHECK(hi < +1000);
+        hi = std::min(+1000, value + delta);
+      }
+      fprintf(stderr, "Aspiration search failed at d=%d v=%d; retrying with [%d,%d]\n", d, value, lo, hi);
+    }
+    for (int i = 1; pool && i < pool->Size(); ++i) {
+      ctx.counters.Add(pool->Context(i).counters);
+    }
+    if (ctx.aborted) {
+      // Out of time. Use the partial results of this iteration, if any.
+      if (!best_moves.empty()) {
+        best_move = *std::min_element(best_moves.begin(), best_moves.end());
+      }
+      fprintf(stderr, "d=%d aborted best=%s\n", d, best_move.field < 0 ? "none" : FormatMove(best_move));
+      break;
+    }
+    previous_value = value;
+    if (stats) {
+      stats->depth = d;
+      stats->value = value;
+    }
+    CHECK(!best_moves.empty());
+    // Always return the best move with the lowest field index. This seems to
     // result in stronger play, though I have no idea why!
     best_move = *std::min_element(best_moves.begin(), best_moves.end());
 
-    fprintf(stderr, "d=%d v=%d best=%s ", d, value, FormatMove(best_move));
-    for (int i = 0; i <= search_depth; ++i) {
-      fprintf(stderr, " %lld", (long long)counter_search[i]);
-    }
-    fputc('\n', stderr);
-    int64_t counter_search_sum = std::accumulate(counter_search.begin(), counter_search.end(), 0);
-    total_evals += counter_search_sum;
+    total_evals = total_nodes();
+    fprintf(stderr, "d=%d v=%d best=%s", d, value, FormatMove(best_move));
+    ctx.counters.Print(d, stderr);
+    fprintf(stderr, " (%.3fm/s)\n", total_evals*1e3/(GetWallTimeNanos() - wall_time_nanos));
 
     // If we searched to the end of the game, there is no point in going deeper.
     if (d == moves_left) break;
@@ -511,26 +2836,63 @@ Move SelectMove(State &state) {
     search_depth += 2;
     if (search_depth > max_search_depth) break;
 
-    // Heuristic: we expect each depth increase to multiply the number of
-    // positions searched by a factor equal to the number of moves left.
-    if (total_evals + moves_left*total_evals > max_nodes) break;
+    if (cap_nanos > 0) {
+      // Estimate the duration of the next iteration from the duration of this
+      // one and the branching factor measured between the node counts of the
+      // last two iterations.
+      // Only start it if the target time has not been used up yet, and it is
+      // expected to finish before the cap. The target is extended while the
+      // best move keeps changing, since more time is then likely to change the
+      // result, and reduced when it is stable.
+      const int64_t now_nanos = GetBudgetTimeNanos();
+      const int64_t iteration_nodes = total_evals - iteration_start_nodes;
+      const double branching = previous_iteration_nodes > 0 ?
+          static_cast<double>(iteration_nodes)/previous_iteration_nodes : moves_left;
+      previous_iteration_nodes = iteration_nodes;
+      if (previous_best_move.field == best_move.field &&
+          previous_best_move.value == best_move.value) {
+        ++stable_iterations;
+      } else if (previous_best_move.field >= 0) {
+        stable_iterations = 0;
+      }
+      const double factor = stable_iterations == 0 ? 1.5 : stable_iterations >= 2 ? 0.75 : 1.0;
+      const int64_t elapsed_nanos = now_nanos - budget_start_nanos;
+      const int64_t predicted_end_nanos = elapsed_nanos +
+          static_cast<int64_t>((now_nanos - iteration_start_nanos)*branching);
+      if (elapsed_nanos > target_nanos*factor || predicted_end_nanos > cap_nanos) break;
+    } else {
+      // Heuristic: we expect each depth increase to multiply the number of
+      // positions searched by a factor equal to the number of moves left.
+      if (total_evals + moves_left*total_evals > max_nodes) break;
+    }
   }
+  search_deadline_nanos = 0;
+  stop_helpers = true;
+  for (std::thread &thread : helper_threads) thread.join();
+  total_evals = total_nodes();
+  pool.reset();
+  deadline_passed = false;
+
   cpu_time_nanos = GetCpuTimeNanos() - cpu_time_nanos;
   wall_time_nanos = GetWallTimeNanos() - wall_time_nanos;
   double cpu_time_secs = 1e-9*cpu_time_nanos;
   double wall_time_secs = 1e-9*wall_time_nanos;
+  if (stats) {
+    stats->nodes = total_evals;
+    stats->wall_time_secs = wall_time_secs;
+  }
   if (cpu_time_secs > 0.1) {
     fprintf(stderr, "%.3lfs cpu %.3lfs wall %.3fm/s\n",
         cpu_time_secs, wall_time_secs, total_evals*1e3/cpu_time_nanos);
   }
+  if (best_move.field < 0) {
+    // Not even the first iteration completed. Play any valid move.
+    best_move = Move{fields[0], HighestBit(UnusedValues(state, GetNextPlayer(state)))};
+  }
   CHECK(IsValidMove(state, best_move));
   return best_move;
 }
 
-int CoordsToFieldIndex(int u, int v) {
-  return SIZE*u - (u*(u - 1) >> 1) + v;
-}
-
 int ParseField(const char *buf) {
   int u = buf[0] - 'A';
   int v = buf[1] - '1';
@@ -578,9 +2940,153 @@ unsigned GetSeed(const vector<Move> &history) {
   return seed;
 }
 
-string EncodeTranscript(const vector<Move> &history) {
-  string result;
-  result.resize(history.size()*2);
+// Opening book: the best first move for every initial configuration of brown
+// stones, up to symmetry. The file consists of a magic number followed by a
+// sorted array of 64-bit entries, each holding the canonical mask of brown
+// stones in bits 10 and up, and the best move (in the canonical orientation)
+// in the lower bits. The file is memory-mapped, so it costs nothing to open.
+class OpeningBook {
+public:
+  static const uint64_t MAGIC = 0x314b4f4f42484253ULL;  // "SBHBOOK1"
+
+  static uint64_t Encode(uint64_t mask, const Move &move) {
+    return mask << 10 | move.field << 4 | move.value;
+  }
+
+  ~OpeningBook() {
+    if (data != MAP_FAILED) munmap(data, size);
+  }
+
+  bool Open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(uint64_t) &&
+        st.st_size % sizeof(uint64_t) == 0) {
+      size = st.st_size;
+      data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    if (*Begin() != MAGIC) {
+      munmap(data, size);
+      data = MAP_FAILED;
+      return false;
+    }
+    return true;
+  }
+
+  // Looks up the first move for the given state, which must be the initial
+  // state. Returns false if the state is not in the book.
+  bool Lookup(const State &state, Move *move) const {
+    if (data == MAP_FAILED || state.moves_played != 0) return false;
+    const int s = symmetries.Canonicalize(state.occupied);
+    const uint64_t key = symmetries.MapMask(s, state.occupied) << 10;
+    const uint64_t *end = Begin() + size/sizeof(uint64_t);
+    const uint64_t *it = std::lower_bound(Begin() + 1, end, key);
+    if (it == end || (*it >> 10) != (key >> 10)) return false;
+    *move = Move{symmetries.Unmap(s, (*it >> 4) & 63), static_cast<int>(*it & 15)};
+    return IsValidMove(state, *move);
+  }
+
+private:
+  const uint64_t *Begin() const { return static_cast<const uint64_t*>(data); }
+
+  void *data = MAP_FAILED;
+  size_t size = 0;
+};
+
+OpeningBook book;
+
+// Searches the given state on a single thread by iterative deepening, within
+// the limits of max_search_depth and max_nodes, like SelectMove() does. Used
+// to search many states in parallel, with one context per thread.
+Move SearchWithinLimits(SearchContext &ctx, State &state, std::minstd_rand &rng,
+    SearchStats *stats = nullptr) {
+  const int64_t wall_time_nanos = GetWallTimeNanos();
+  const FieldList fields = CalculateFieldsToSearch(state, &rng);
+  const int moves_left = MAX_MOVES - state.moves_played;
+  ctx.nodes = 0;
+  ctx.AgeMoveOrdering();
+  Move best_move = {-1, 0};
+  for (int search_depth = min_search_depth; search_depth <= max_search_depth; search_depth += 2) {
+    const int d = std::min(search_depth, moves_left);
+    ctx.counters.Clear();
+    MoveList best_moves;
+    const int value = Search(ctx, state, d, -1000, +1000, &best_moves, fields);
+    CHECK(!best_moves.empty());
+    best_move = *std::min_element(best_moves.begin(), best_moves.end());
+    if (stats) {
+      stats->depth = d;
+      stats->value = value;
+    }
+    if (d == moves_left) break;
+    const int64_t nodes = ctx.nodes;
+    if (nodes + moves_left*nodes > max_nodes) break;
+  }
+  if (stats) {
+    stats->nodes = ctx.nodes;
+    stats->wall_time_secs = 1e-9*(GetWallTimeNanos() - wall_time_nanos);
+  }
+  return best_move;
+}
+
+// Generates the opening book by searching all canonical initial states, using
+// num_threads threads, and writes it to book_path. Like in RunBatch(), every
+// state is searched with tables that are cleared first, and a random generator
+// seeded from the state, so the book does not depend on scheduling.
+void GenerateBook() {
+  vector<uint64_t> masks;
+  const uint64_t last = ((uint64_t{1} << INITIAL_STONES) - 1) << (NUM_FIELDS - INITIAL_STONES);
+  for (uint64_t mask = (uint64_t{1} << INITIAL_STONES) - 1; ; ) {
+    // Symmetry 0 is the identity, so this holds only for canonical masks.
+    if (symmetries.Canonicalize(mask) == 0) masks.push_back(mask);
+    if (mask == last) break;
+    // Next mask with the same number of bits set (Gosper's hack).
+    uint64_t c = mask & -mask, r = mask + c;
+    mask = (((r ^ mask) >> 2) / c) | r;
+  }
+  fprintf(stderr, "Generating opening book for %d positions...\n", (int)masks.size());
+  log_root_moves = false;
+  max_nodes = book_max_nodes;
+
+  vector<uint64_t> entries(masks.size());
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    TranspositionTable table, endgame;
+    table.Resize(tt_size_mb << 20);
+    endgame.Resize(endgame_table_size_mb << 20);
+    for (size_t i; (i = next++) < masks.size(); ) {
+      State state;
+      for (uint64_t m = masks[i]; m; ) MakeHole(state, PopLowestBit(m));
+      table.Clear();
+      endgame.Clear();
+      SearchContext ctx;
+      ctx.table = &table;
+      ctx.endgame = &endgame;
+      std::minstd_rand rng(masks[i] % std::minstd_rand::modulus);
+      entries[i] = OpeningBook::Encode(masks[i], SearchWithinLimits(ctx, state, rng));
+      if ((i + 1) % 1000 == 0) fprintf(stderr, "%d positions searched\n", (int)(i + 1));
+    }
+  };
+  vector<std::thread> threads;
+  for (int i = 0; i < num_threads; ++i) threads.emplace_back(worker);
+  for (std::thread &thread : threads) thread.join();
+
+  FILE *fp = fopen(book_path, "wb");
+  CHECK(fp != nullptr);
+  const uint64_t magic = OpeningBook::MAGIC;
+  CHECK(fwrite(&magic, sizeof(magic), 1, fp) == 1);
+  CHECK(fwrite(entries.data(), sizeof(uint64_t), entries.size(), fp) == entries.size());
+  CHECK(fclose(fp) == 0);
+  fprintf(stderr, "Wrote %d entries to %s\n", (int)entries.size(), book_path);
+}
+
+// Returns a static buffer, like FormatMove().
+const char *EncodeTranscript(const vector<Move> &history) {
+  static char result[2*(INITIAL_STONES + MAX_MOVES) + 1];
+  CHECK(history.size() <= INITIAL_STONES + MAX_MOVES);
+  result[history.size()*2] = '\0';
   for (size_t i = 0; i < history.size(); ++i) {
     int field = history[i].field;
     int value = history[i].value;
@@ -601,23 +3107,31 @@ string EncodeTranscript(const vector<Move> &history) {
 void RunGame(vector<Move> &history) {
   srand(GetSeed(history));
   State state = GetState(history);
+  history.reserve(INITIAL_STONES + MAX_MOVES);
   const char *line = ReadNextLine();
   if (line == nullptr) return;
+  // Number of heap allocations when the last move was received.
+  int64_t received_allocations = heap_allocations.load();
   int my_player = GetNextPlayer(state);
   if (strcmp(line, "Start") == 0) {
     line = nullptr;
   } else {
     my_player = 1 - my_player;
   }
+  Ponderer ponderer;
   while (!IsGameOver(state)) {
     Validate(state, history);
     Move move;
     if (GetNextPlayer(state) == my_player) {
-      move = SelectMove(state);
+      if (book.Lookup(state, &move)) {
+        fprintf(stderr, "Book move: %s\n", FormatMove(move));
+      } else {
+        move = SelectMove(state);
+      }
       // If this is the last move my player will play, then print a transcript
       // just before sending the last move, to make sure it ends up in the logs.
       if (MAX_MOVES - state.moves_played <= 2) {
-        fprintf(stderr, "Transcript: %s\n", EncodeTranscript(history).c_str());
+        fprintf(stderr, "Transcript: %s\n", EncodeTranscript(history));
         double wall_time_used = (GetWallTimeNanos() - wall_time_start_nanos -
             wall_time_suspended_nanos)/1e9;
         double cpu_time_used = GetCpuTimeNanos()/1e9;
@@ -625,12 +3139,21 @@ void RunGame(vector<Move> &history) {
                 wall_time_used, cpu_time_used);
         fflush(stderr);
       }
+      const int64_t allocations = heap_allocations.load() - received_allocations;
+      if (check_allocations && allocations != 0) {
+        fprintf(stderr, "%lld heap allocations while selecting a move!\n", (long long)allocations);
+        abort();
+      }
       WriteMove(move);
     } else {
       if (line == nullptr) {
+        // Pondering fills the transposition table, which MCTS does not use.
+        if (enable_pondering && engine == Engine::ALPHA_BETA) ponderer.Start(state);
         line = ReadNextLine();
+        ponderer.Stop();
         if (line == nullptr) return;
       }
+      received_allocations = heap_allocations.load();
       move = ParseMove(line);
       line = nullptr;
     }
@@ -648,7 +3171,7 @@ vector<Move> ReadInitialStones() {
     const char *line = ReadNextLine();
     if (line == nullptr) return result;
     int field = ParseField(line);
-    if (field < 0 || field >= NUM_FIELDS || state.occupied[field]) return result;
+    if (field < 0 || field >= NUM_FIELDS || IsOccupied(state, field)) return result;
     MakeHole(state, field);
     moves.push_back(Move{field, 0});
   }
@@ -669,7 +3192,7 @@ vector<Move> DecodeStateString(const char *str) {
   for (int i = 0; i < len; i += 2) {
     int field = DecodeBase36Char(str[i + 0]);
     int value = DecodeBase36Char(str[i + 1]);
-    if (state.occupied[field]) {
+    if (field < 0 || value < 0 || IsOccupied(state, field)) {
       return result;
     }
     if (i < 2*INITIAL_STONES) {
@@ -680,7 +3203,7 @@ vector<Move> DecodeStateString(const char *str) {
       int player = ((i - INITIAL_STONES) >> 1) & 1;
       value -= player*MAX_VALUE;
       if (value < 1 || value > MAX_VALUE) return result;
-      if (state.used[player][value]) return result;
+      if (IsUsed(state, player, value)) return result;
       DoMove(state, Move{field, value});
       moves.push_back(Move{field, value});
     }
@@ -689,12 +3212,344 @@ vector<Move> DecodeStateString(const char *str) {
   return result;
 }
 
+// Formats the result of searching a state as a JSON line, as printed by the
+// benchmark, batch and serve modes. The status is only included if given.
+string FormatResultJson(int index, const char *state_string, const Move &move,
+    const SearchStats &stats, const Counters &counters, const char *status = nullptr) {
+  const string status_json = status ? Sprintf("\"status\": \"%s\", ", status) : string();
+  return Sprintf("{\"index\": %d, \"state\": \"%s\", %s\"depth\": %d, \"value\": %d, "
+      "\"best\": \"%s\", \"nodes\": %lld, \"time\": %.6f, \"nps\": %.0f%s}\n",
+      index, state_string, status_json.c_str(), stats.depth, stats.value, FormatMove(move),
+      (long long)stats.nodes,
+      stats.wall_time_secs, stats.nodes/std::max(stats.wall_time_secs, 1e-9),
+      counters.FormatJson(stats.depth).c_str());
+}
+
+// Analyzes the states read from stdin, one per line, on num_threads worker
+// threads. Each worker searches one state at a time with a fresh context, and
+// its own tables, which are cleared before each state, so that results do not depend on
+// the other states or on scheduling. Results are printed as JSON lines in input
+// order, as soon as all earlier states are done.
+void RunBatch() {
+  vector<string> lines;
+  char line[1024];
+  while (fgets(line, sizeof(line), stdin) != NULL) {
+    char *nl = strchr(line, '\n');
+    if (nl != NULL) *nl = '\0';
+    if (line[0] == '\0' || line[0] == '#') continue;
+    lines.push_back(line);
+  }
+  fprintf(stderr, "Analyzing %d states on %d threads...\n", (int)lines.size(), num_threads);
+  log_root_moves = false;
+  const int64_t wall_time_nanos = GetWallTimeNanos();
+
+  vector<string> results(lines.size());
+  vector<bool> done(lines.size());
+  std::mutex mutex;
+  std::condition_variable result_ready;
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    TranspositionTable table, endgame;
+    table.Resize(tt_size_mb << 20);
+    endgame.Resize(endgame_table_size_mb << 20);
+    for (size_t i; (i = next++) < lines.size(); ) {
+      string result;
+      vector<Move> moves = DecodeStateString(lines[i].c_str());
+      if (moves.empty()) {
+        result = Sprintf("{\"index\": %d, \"error\": \"invalid state\"}\n", (int)i);
+      } else {
+        State state = GetState(moves);
+        if (IsGameOver(state)) {
+          result = Sprintf("{\"index\": %d, \"state\": \"%s\", \"error\": \"game over\"}\n",
+              (int)i, lines[i].c_str());
+        } else {
+          table.Clear();
+          endgame.Clear();
+          SearchContext ctx;
+          ctx.table = &table;
+          ctx.endgame = &endgame;
+          std::minstd_rand rng(GetSeed(moves));
+          SearchStats stats;
+          Move move = SearchWithinLimits(ctx, state, rng, &stats);
+          result = FormatResultJson(i, lines[i].c_str(), move, stats, ctx.counters);
+        }
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        results[i] = std::move(result);
+        done[i] = true;
+      }
+      result_ready.notify_one();
+    }
+  };
+  vector<std::thread> threads;
+  for (int i = 0; i < num_threads; ++i) threads.emplace_back(worker);
+  for (size_t i = 0; i < lines.size(); ++i) {
+    std::unique_lock<std::mutex> lock(mutex);
+    result_ready.wait(lock, [&]() { return done[i]; });
+    fputs(results[i].c_str(), stdout);
+    fflush(stdout);
+    results[i].clear();
+  }
+  for (std::thread &thread : threads) thread.join();
+  const double wall_time_secs = 1e-9*(GetWallTimeNanos() - wall_time_nanos);
+  fprintf(stderr, "Analyzed %d states in %.3fs (%.1f states/s)\n", (int)lines.size(),
+      wall_time_secs, lines.size()/std::max(wall_time_secs, 1e-9));
+}
+
+// Returns the string with the characters that are special in JSON strings
+// escaped.
+string EscapeJson(const char *s) {
+  string result;
+  for (; *s; ++s) {
+    const unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    } else if (c < 0x20) {
+      result += Sprintf("\\u%04x", c);
+    } else {
+      result += c;
+    }
+  }
+  return result;
+}
+
+// Long-lived analysis server (serve mode). Requests are read line by line:
+//
+//   analyze <state> [depth=<N>] [nodes=<N>] [time=<S>]
+//     Analyzes the state by iterative deepening on a single thread, and prints
+//     a JSON line (see FormatResultJson()) with status "iteration" after each
+//     completed iteration, and a last line with status "done", or "stopped"
+//     if the analysis was interrupted. The limits default to
+//     --max_search_depth, --max_nodes and --move_time. A line with just a
+//     state string is short for "analyze <state>".
+//     The "depth" of a response is a lower bound: since the tables are kept,
+//     values found by deeper searches of earlier requests are reused, so a
+//     repeated analysis may report a different value for the same depth than
+//     the first one. Send "clear" first to get the result of a cold search.
+//   stop
+//     Stops the current analysis. Analyses that have not started are skipped,
+//     and answered with just {"index": <N>, "status": "stopped"}.
+//   clear
+//     Clears the transposition table, the endgame table and the move
+//     ordering heuristics.
+//   quit
+//     Stops the current analysis and closes the connection.
+//
+// Requests are executed in order by a worker thread, while the reader thread
+// handles "stop" and "quit" immediately. At the end of the input, the
+// requests that were read are completed first. The tables are kept between
+// requests (and connections), so that repeated and related analyses, like
+// those of successive positions of a game, mostly hit the tables.
+class AnalysisServer {
+public:
+  AnalysisServer() { ctx.stop = &stop; }
+
+  // Serves the requests read from `in`, writing responses to `out`.
+  void Serve(FILE *in, FILE *out) {
+    closed = false;
+    std::thread worker(&AnalysisServer::Work, this, out);
+    char line[1024];
+    int index = 0;
+    while (fgets(line, sizeof(line), in) != NULL) {
+      char *nl = strchr(line, '\n');
+      if (nl != NULL) *nl = '\0';
+      if (line[0] == '\0' || line[0] == '#') continue;
+      std::lock_guard<std::mutex> lock(mutex);
+      if (strcmp(line, "stop") == 0 || strcmp(line, "quit") == 0) {
+        // Analyses that have not started are answered as stopped, so that
+        // every request gets a final response.
+        for (Request &request : pending) {
+          if (request.command != "clear") request.dropped = true;
+        }
+        stop = true;
+        if (strcmp(line, "quit") == 0) break;
+        continue;
+      }
+      pending.push_back(Request{index++, line, false});
+      request_ready.notify_one();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+    }
+    request_ready.notify_one();
+    worker.join();
+  }
+
+private:
+  struct Request {
+    int index;
+    string command;
+    bool dropped;  // stopped before it started
+  };
+
+  // Executes requests until the input is closed and no requests are left.
+  void Work(FILE *out) {
+    for (;;) {
+      Request request;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        request_ready.wait(lock, [this]() { return closed || !pending.empty(); });
+        if (pending.empty()) return;
+        request = std::move(pending.front());
+        pending.pop_front();
+        stop = false;
+      }
+      string response;
+      if (request.dropped) {
+        response = Sprintf("{\"index\": %d, \"status\": \"stopped\"}\n", request.index);
+      } else if (request.command == "clear") {
+        tt.Clear();
+        endgame_table.Clear();
+        ctx.ClearMoveOrdering();
+        response = Sprintf("{\"index\": %d, \"status\": \"cleared\"}\n", request.index);
+      } else {
+        response = Analyze(request, out);
+      }
+      fputs(response.c_str(), out);
+      fflush(out);
+    }
+  }
+
+  // Executes an analyze request, printing the result of each iteration to
+  // `out`. Returns the final response.
+  string Analyze(const Request &request, FILE *out) {
+    char state_string[1024];
+    int depth_limit = max_search_depth;
+    int64_t nodes_limit = max_nodes;
+    double time_limit = move_time;
+    const char *args = request.command.c_str();
+    if (strncmp(args, "analyze ", 8) == 0) args += 8;
+    int n = 0;
+    if (sscanf(args, "%1023s%n", state_string, &n) != 1) {
+      return Sprintf("{\"index\": %d, \"error\": \"invalid request\"}\n", request.index);
+    }
+    for (args += n; *args; args += n) {
+      char arg[64];
+      long long long_arg;
+      if (sscanf(args, " %63s%n", arg, &n) != 1) break;
+      if (!(sscanf(arg, "depth=%d", &depth_limit) == 1 && depth_limit > 0) &&
+          !(sscanf(arg, "nodes=%lld", &long_arg) == 1 && (nodes_limit = long_arg) > 0) &&
+          !(sscanf(arg, "time=%lf", &time_limit) == 1 && time_limit >= 0)) {
+        return Sprintf("{\"index\": %d, \"error\": \"invalid argument: %s\"}\n",
+            request.index, EscapeJson(arg).c_str());
+      }
+    }
+    vector<Move> moves = DecodeStateString(state_string);
+    if (moves.empty()) {
+      return Sprintf("{\"index\": %d, \"error\": \"invalid state\"}\n", request.index);
+    }
+    State state = GetState(moves);
+    if (IsGameOver(state)) {
+      return Sprintf("{\"index\": %d, \"state\": \"%s\", \"error\": \"game over\"}\n",
+          request.index, state_string);
+    }
+
+    const int64_t wall_time_nanos = GetWallTimeNanos();
+    std::minstd_rand rng(GetSeed(moves));
+    const FieldList fields = CalculateFieldsToSearch(state, &rng);
+    const int moves_left = MAX_MOVES - state.moves_played;
+    ctx.nodes = 0;
+    ctx.next_deadline_check = 0;
+    ctx.aborted = false;
+    ctx.AgeMoveOrdering();
+    search_deadline_nanos = time_limit > 0 ?
+        GetBudgetTimeNanos() + static_cast<int64_t>(time_limit*NANOS_PER_SECOND) : 0;
+    deadline_passed = false;
+    SearchStats stats;
+    Move best_move = {-1, 0};
+    for (int search_depth = min_search_depth; ; search_depth += 2) {
+      const int d = std::min(std::min(search_depth, depth_limit), moves_left);
+      ctx.counters.Clear();
+      MoveList best_moves;
+      const int value = Search(ctx, state, d, -1000, +1000, &best_moves, fields);
+      if (ctx.aborted) {
+        // Keep the partial results of the first iteration, as SelectMove() does.
+        if (best_move.field < 0 && !best_moves.empty()) {
+          best_move = *std::min_element(best_moves.begin(), best_moves.end());
+        }
+        break;
+      }
+      CHECK(!best_moves.empty());
+      best_move = *std::min_element(best_moves.begin(), best_moves.end());
+      stats.depth = d;
+      stats.value = value;
+      stats.nodes = ctx.nodes;
+      stats.wall_time_secs = 1e-9*(GetWallTimeNanos() - wall_time_nanos);
+      fputs(FormatResultJson(request.index, state_string, best_move, stats, ctx.counters,
+          "iteration").c_str(), out);
+      fflush(out);
+      if (d == moves_left || d == depth_limit) break;
+      if (stats.nodes + moves_left*stats.nodes > nodes_limit) break;
+    }
+    // Running out of time completes the analysis; only a stop request does not.
+    const bool stopped = ctx.aborted && !deadline_passed;
+    search_deadline_nanos = 0;
+    deadline_passed = false;
+    if (best_move.field < 0) {
+      // Not even the first iteration completed. Report any valid move.
+      best_move = Move{fields[0], HighestBit(UnusedValues(state, GetNextPlayer(state)))};
+    }
+    stats.nodes = ctx.nodes;
+    stats.wall_time_secs = 1e-9*(GetWallTimeNanos() - wall_time_nanos);
+    return FormatResultJson(request.index, state_string, best_move, stats, ctx.counters,
+        stopped ? "stopped" : "done");
+  }
+
+  SearchContext ctx;
+  std::atomic<bool> stop{false};
+  std::mutex mutex;
+  std::condition_variable request_ready;
+  std::deque<Request> pending;
+  bool closed = false;
+};
+
+// Runs the analysis server on stdin and stdout, or on socket_path if given,
+// where it serves one connection at a time.
+void RunServer() {
+  log_root_moves = false;
+  AnalysisServer server;
+  if (socket_path == nullptr) {
+    server.Serve(stdin, stdout);
+    return;
+  }
+  // Writes to a connection that was closed by the client should fail, rather
+  // than terminate the server.
+  signal(SIGPIPE, SIG_IGN);
+  const int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  CHECK(listen_fd >= 0);
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  CHECK(strlen(socket_path) < sizeof(addr.sun_path));
+  strcpy(addr.sun_path, socket_path);
+  unlink(socket_path);
+  CHECK(bind(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0);
+  CHECK(listen(listen_fd, 16) == 0);
+  fprintf(stderr, "Listening on %s\n", socket_path);
+  for (;;) {
+    const int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) continue;
+    FILE *in = fdopen(fd, "r");
+    FILE *out = fdopen(dup(fd), "w");
+    CHECK(in != nullptr && out != nullptr);
+    server.Serve(in, out);
+    fclose(out);
+    fclose(in);
+  }
+}
+
 void PrintPlayerId() {
   fprintf(stderr, "%s %d (gcc %s glibc++ %d)",
       PLAYER_NAME, PLAYER_VERSION, __VERSION__, __GLIBCXX__);
 #if __x86_64__
   fputs(" x86_64", stderr);
 #endif
+  fprintf(stderr, " %s", kernels_names[requested_kernels]);
+  if (num_threads > 1) {
+    fprintf(stderr, " %dx%s", num_threads, parallel_mode_names[static_cast<int>(parallel_mode)]);
+  }
 #if __OPTIMIZE__
   fputs(" optimized", stderr);
 #endif
@@ -708,7 +3563,7 @@ void PrintPlayerId() {
   fputc('\n', stderr);
 }
 
-enum class Mode { PLAY, ANALYZE, BENCHMARK };
+enum class Mode { PLAY, ANALYZE, BENCHMARK, BATCH, SERVE, BOOK };
 
 struct Args {
   Mode mode = Mode::PLAY;
@@ -723,12 +3578,67 @@ struct Args {
 //
 //    play       (default) Play a game.
 //    analyze    Analyze a single game state.
-//    benchmark  Run benchmark on states read from stdin.
+//    benchmark  Run benchmark on states read from stdin (e.g. benchmark.txt),
+//               and print the results as JSON lines (see compare-benchmarks.py).
+//    batch      Analyze many states read from stdin in parallel, searching one
+//               state per thread within --max_nodes and --max_search_depth,
+//               and print the results as JSON lines in input order. Each
+//               thread allocates its own --tt_size and --endgame_table_size
+//               tables.
+//    serve      Analyze states on request, keeping the search tables between
+//               requests. Commands are read from stdin, or from connections
+//               to --socket, one per line (see AnalysisServer).
+//    book       Generate the opening book and write it to the --book file.
 //
 // Supported options:
 //
 //  -d<N> / --max_search_depth=<N>  set the maximum search depth to N
 //  --max_nodes=<N>                 set target number of nodes to evaluate to N
+//  --move_time=<S>                 search each move for at most S seconds
+//                                  (overrides --max_nodes)
+//  --game_time=<S>                 allocate S seconds for the whole game over
+//                                  the moves (overrides --move_time)
+//  --cpu_time                      measure --move_time and --game_time in CPU
+//                                  time rather than wall time
+//  --ponder                        search while the opponent is thinking
+//                                  (counts against the budget with --cpu_time)
+//  --check_allocations             abort if the heap is used between receiving
+//                                  a move and sending ours (requires
+//                                  --threads=1, since threads are started
+//                                  for each move)
+//  --tt_size=<N>                   set transposition table size to N megabytes
+//                                  (0 disables the transposition table)
+//  --endgame_fields=<N>            solve positions with at most N empty fields
+//                                  exactly (0 disables the endgame solver)
+//  --endgame_table_size=<N>        set endgame table size to N megabytes
+//  --aspiration_window=<N>         initial aspiration window size (0 disables)
+//  --aspiration_growth=<N>         aspiration window growth factor on failure
+//  --threads=<N>                   use N search threads (default: 1)
+//  --parallel=<name>               parallel search mode with multiple threads:
+//                                  lazy (default) or ybwc
+//  --engine=<name>                 engine to select moves with: alphabeta
+//                                  (default) or mcts
+//  --mcts_exploration=<C>          UCT exploration constant (default: 0.5)
+//  --mcts_tree_size=<N>            size of the MCTS node arena in megabytes
+//  --playouts=<name>               MCTS playouts: guided (default) or random
+//  --values=<name>                 values to search for each move: top
+//                                  (default), all, or dominance (all values,
+//                                  except provably dominated ones)
+//  --kernels=<name>                use scalar, sse4 or avx2 kernels for score
+//                                  updates (default: best supported by CPU)
+//  --book=<filename>               opening book to play the first move from
+//                                  (in book mode: the file to write)
+//  --book_max_nodes=<N>            target number of nodes to evaluate for each
+//                                  position in book mode (default: 25m)
+//  --cache=<filename>              persistent analysis cache, shared with other
+//                                  processes that use the same file
+//  --cache_size=<N>                size in megabytes of a new cache file
+//                                  (default: 256)
+//  --socket=<filename>             in serve mode, listen on this Unix socket
+//                                  instead of using stdin and stdout
+//  +o / -o                         enable/disable static move ordering
+//  +k / -k                         enable/disable killer and history move
+//                                  ordering inside the search
 //
 // base36-game-state: If given, continue from the given game state, instead of
 // starting with an empty board. The state must include at least the initial
@@ -747,6 +3657,21 @@ Args ParseArgs(int argc, char *argv[]) {
       args.mode = Mode::BENCHMARK;
       continue;
     }
+    if (strcmp(argv[i], "batch") == 0) {
+      CHECK(args.mode == Mode::PLAY);
+      args.mode = Mode::BATCH;
+      continue;
+    }
+    if (strcmp(argv[i], "serve") == 0) {
+      CHECK(args.mode == Mode::PLAY);
+      args.mode = Mode::SERVE;
+      continue;
+    }
+    if (strcmp(argv[i], "book") == 0) {
+      CHECK(args.mode == Mode::PLAY);
+      args.mode = Mode::BOOK;
+      continue;
+    }
     vector<Move> moves = DecodeStateString(argv[i]);
     if (!moves.empty()) {
       CHECK(args.transcript.empty());
@@ -760,16 +3685,149 @@ Args ParseArgs(int argc, char *argv[]) {
       max_search_depth = int_arg;
       continue;
     }
+    if (sscanf(argv[i], "--aspiration_window=%d", &int_arg) == 1) {
+      CHECK(int_arg >= 0);
+      aspiration_window = int_arg;
+      continue;
+    }
+    if (sscanf(argv[i], "--aspiration_growth=%d", &int_arg) == 1) {
+      CHECK(int_arg >= 1);
+      aspiration_growth = int_arg;
+      continue;
+    }
+    if (sscanf(argv[i], "--endgame_fields=%d", &int_arg) == 1) {
+      CHECK(int_arg >= 0);
+      endgame_empty_fields = int_arg;
+      continue;
+    }
+    if (sscanf(argv[i], "--threads=%d", &int_arg) == 1) {
+      CHECK(int_arg > 0);
+      num_threads = int_arg;
+      continue;
+    }
+    double double_arg = 0;
+    if (sscanf(argv[i], "--move_time=%lf", &double_arg) == 1) {
+      CHECK(double_arg >= 0);
+      move_time = double_arg;
+      continue;
+    }
+    if (sscanf(argv[i], "--mcts_exploration=%lf", &double_arg) == 1) {
+      CHECK(double_arg >= 0);
+      mcts_exploration = double_arg;
+      continue;
+    }
+    if (sscanf(argv[i], "--game_time=%lf", &double_arg) == 1) {
+      CHECK(double_arg >= 0);
+      game_time = double_arg;
+      continue;
+    }
+    if (strcmp(argv[i], "--cpu_time") == 0) {
+      use_cpu_time = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--ponder") == 0) {
+      enable_pondering = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--check_allocations") == 0) {
+      check_allocations = true;
+      continue;
+    }
     long long long_arg = 0;
     if (sscanf(argv[i], "--max_nodes=%lld", &long_arg) == 1) {
       CHECK(max_nodes > 0);
       max_nodes = long_arg;
       continue;
     }
+    if (sscanf(argv[i], "--tt_size=%lld", &long_arg) == 1) {
+      CHECK(long_arg >= 0);
+      tt_size_mb = long_arg;
+      continue;
+    }
+    if (sscanf(argv[i], "--book_max_nodes=%lld", &long_arg) == 1) {
+      CHECK(long_arg > 0);
+      book_max_nodes = long_arg;
+      continue;
+    }
+    if (sscanf(argv[i], "--mcts_tree_size=%lld", &long_arg) == 1) {
+      CHECK(long_arg > 0);
+      mcts_tree_size_mb = long_arg;
+      continue;
+    }
+    if (sscanf(argv[i], "--cache_size=%lld", &long_arg) == 1) {
+      CHECK(long_arg > 0);
+      cache_size_mb = long_arg;
+      continue;
+    }
+    if (sscanf(argv[i], "--endgame_table_size=%lld", &long_arg) == 1) {
+      CHECK(long_arg >= 0);
+      endgame_table_size_mb = long_arg;
+      continue;
+    }
+    if (strncmp(argv[i], "--parallel=", 11) == 0) {
+      int j = 0;
+      while (j < (int)ArraySize(parallel_mode_names) && strcmp(argv[i] + 11, parallel_mode_names[j]) != 0) ++j;
+      CHECK(j < (int)ArraySize(parallel_mode_names));
+      parallel_mode = static_cast<ParallelMode>(j);
+      continue;
+    }
+    if (strncmp(argv[i], "--book=", 7) == 0) {
+      book_path = argv[i] + 7;
+      continue;
+    }
+    if (strncmp(argv[i], "--cache=", 8) == 0) {
+      cache_path = argv[i] + 8;
+      continue;
+    }
+    if (strncmp(argv[i], "--socket=", 9) == 0) {
+      socket_path = argv[i] + 9;
+      continue;
+    }
+    if (strncmp(argv[i], "--engine=", 9) == 0) {
+      int j = 0;
+      while (j < (int)ArraySize(engine_names) && strcmp(argv[i] + 9, engine_names[j]) != 0) ++j;
+      CHECK(j < (int)ArraySize(engine_names));
+      engine = static_cast<Engine>(j);
+      continue;
+    }
+    if (strcmp(argv[i], "--playouts=guided") == 0) {
+      mcts_guided_playouts = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--playouts=random") == 0) {
+      mcts_guided_playouts = false;
+      continue;
+    }
+    if (strncmp(argv[i], "--values=", 9) == 0) {
+      int j = 0;
+      while (j < (int)ArraySize(value_mode_names) && strcmp(argv[i] + 9, value_mode_names[j]) != 0) ++j;
+      CHECK(j < (int)ArraySize(value_mode_names));
+      value_mode = static_cast<ValueMode>(j);
+      continue;
+    }
+    if (strncmp(argv[i], "--kernels=", 10) == 0) {
+      int j = 0;
+      while (j < (int)ArraySize(kernels_names) && strcmp(argv[i] + 10, kernels_names[j]) != 0) ++j;
+      CHECK(j < (int)ArraySize(kernels_names));
+      requested_kernels = j;
+      continue;
+    }
     if (strcmp(argv[i], "+o") == 0) {
       enable_move_ordering = true;
       continue;
     }
+    if (strcmp(argv[i], "-o") == 0) {
+      enable_move_ordering = false;
+      continue;
+    }
+    if (strcmp(argv[i], "+k") == 0) {
+      enable_killer_history = true;
+      continue;
+    }
+    if (strcmp(argv[i], "-k") == 0) {
+      enable_killer_history = false;
+      continue;
+    }
     fprintf(stderr, "Ignored argument %d: [%s]\n", i, argv[i]);
   }
   return args;
@@ -779,6 +3837,13 @@ int Main(int argc, char *argv[]) {
   wall_time_start_nanos = GetWallTimeNanos();
 
   Args args = ParseArgs(argc, argv);
+  tt.Resize(tt_size_mb << 20);
+  endgame_table.Resize(endgame_table_size_mb << 20);
+  if (engine == Engine::MCTS) mcts_arena.Reserve();
+  requested_kernels = static_cast<int>(SelectKernels(static_cast<Kernels>(requested_kernels)));
+  if (cache_path && !cache.Open(cache_path, cache_size_mb << 20)) {
+    fprintf(stderr, "Failed to open analysis cache %s!\n", cache_path);
+  }
   if (args.mode == Mode::PLAY) {
     PrintPlayerId();
     std::vector<Move> history = args.transcript;
@@ -789,6 +3854,9 @@ int Main(int argc, char *argv[]) {
         return 1;
       }
     }
+    if (book_path && !book.Open(book_path)) {
+      fprintf(stderr, "Failed to open opening book %s!\n", book_path);
+    }
     RunGame(history);
     fprintf(stderr, "Exiting.\n");
   } else if (args.mode == Mode::ANALYZE) {
@@ -797,25 +3865,47 @@ int Main(int argc, char *argv[]) {
     Move move = SelectMove(state);
     fprintf(stderr, "Best move: %s\n", FormatMove(move));
   } else if (args.mode == Mode::BENCHMARK) {
+    // Each position is searched from scratch, so that results do not depend on
+    // the other positions, and the results are printed to stdout as JSON lines.
     char line[1024];
-    vector<int64_t> total_search(MAX_MOVES + 1);
+    Counters total_counters;
+    int max_depth = 0;
+    int index = 0;
     while (fgets(line, sizeof(line), stdin) != NULL) {
       char *nl = strchr(line, '\n');
       CHECK(nl != NULL);
       *nl = '\0';
+      if (line[0] == '\0' || line[0] == '#') continue;
       vector<Move> moves = DecodeStateString(line);
       if (moves.empty()) {
         fprintf(stderr, "Invalid state string: [%s]\n", line);
         return 1;
       }
       State state = GetState(moves);
-      SelectMove(state);
-      for (size_t i = 0; i < counter_search.size(); ++i) total_search[i] += counter_search[i];
+      srand(GetSeed(moves));
+      tt.Clear();
+      endgame_table.Clear();
+      main_context.ClearMoveOrdering();
+      SearchStats stats;
+      Move move = SelectMove(state, &stats);
+      total_counters.Add(main_context.counters);
+      max_depth = std::max(max_depth, stats.depth);
+      fputs(FormatResultJson(index++, line, move, stats, main_context.counters).c_str(), stdout);
+      fflush(stdout);
     }
-    for (int i = 0; i <= MAX_MOVES && total_search[i]; ++i) {
-      fprintf(stderr, "%lld ", (long long)total_search[i]);
+    if (Counters::ENABLED) {
+      int64_t total = 0;
+      for (int i = 0; i <= max_depth; ++i) total += total_counters.Nodes(i);
+      total_counters.Print(max_depth, stderr);
+      fprintf(stderr, " (total: %lld)\n", (long long)total);
     }
-    fprintf(stderr, "(total: %lld)\n", std::accumulate(total_search.begin(), total_search.end(), 0LL));
+  } else if (args.mode == Mode::BATCH) {
+    RunBatch();
+  } else if (args.mode == Mode::SERVE) {
+    RunServer();
+  } else if (args.mode == Mode::BOOK) {
+    CHECK(book_path != nullptr);
+    GenerateBook();
   }
   return 0;
 }